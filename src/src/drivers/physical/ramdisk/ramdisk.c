@@ -103,8 +103,8 @@ top:
 
     case RD_CMD_READ:	
 	DB(("dev->ram = %p\n", dev->ram));
-	memcpy(req->buf, dev->ram + (req->block * FS_BLKSIZ/2),
-		req->nblocks * FS_BLKSIZ/2);
+	memcpy(req->buf, dev->ram + (req->block * 512),
+		req->nblocks * 512);
 	end_request(0);
 	req = NULL;
 	goto top;
@@ -112,8 +112,8 @@ top:
 
     case RD_CMD_WRITE:
 	DB(("dev->ram = %p\n", dev->ram));
-	memcpy(dev->ram + (req->block * FS_BLKSIZ/2), req->buf,
-		req->nblocks * FS_BLKSIZ/2);
+	memcpy(dev->ram + (req->block * 512), req->buf,
+		req->nblocks * 512);
 	end_request(0);
 	req = NULL;
 	goto top;
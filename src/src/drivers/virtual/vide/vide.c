@@ -40,6 +40,9 @@ struct vide {
     u_long buf_index, block, blocks_left;
     u_char buf[512];
 
+    /* Image file transfers to and from BUF are done asynchronously. */
+    struct fs_request req;
+
     struct vm_kill_handler kh;
 };
 
@@ -67,7 +70,11 @@ delete_vide(struct vm *vm)
     {
 	vm->slots[vm_slot] = NULL;
 	if(v->is_file)
+	{
+	    if(!fs->cancel_request(&v->req))
+		fs->wait_request(&v->req);
 	    fs->close(v->vdisk.file);
+	}
 	kernel->free(v);
 	vide_module.base.vxd_base.open_count--;
     }
@@ -89,6 +96,7 @@ create_vide(struct vm *vmach, int argc, char **argv)
     {
 	u_long namelen = strlen(argv[0]);
 	new->vm = vmach;
+	new->req.completed = TRUE;
 	if(argv[0][namelen-1] == ':')
 	{
 	    /* Device-spec. */
@@ -194,11 +202,30 @@ create_vide(struct vm *vmach, int argc, char **argv)
 
 /* I/O port virtualisation. */
 
+/* Wait for any outstanding transfer of V's image file. */
+static inline void
+wait_for_file(struct vide *v)
+{
+    if(!v->req.completed)
+	fs->wait_request(&v->req);
+}
+
+/* Returns TRUE while a transfer of V's image file is in progress. The
+   request and the buffer belong to the fs-aio task until it completes,
+   so the guest's accesses to the data and command registers are ignored
+   (as a real controller does while it's busy). */
+static inline bool
+file_busy_p(struct vide *v)
+{
+    return v->is_file && !v->req.completed;
+}
+
 static inline bool
 read_one_block(struct vide *v, u_long blkno, void *buf)
 {
     if(v->is_file)
     {
+	wait_for_file(v);
 	return ((fs->seek(v->vdisk.file, blkno * 512, SEEK_ABS) >= 0)
 		&& (fs->read(buf, 512, v->vdisk.file) == 512));
     }
@@ -211,6 +238,7 @@ write_one_block(struct vide *v, u_long blkno, void *buf)
 {
     if(v->is_file)
     {
+	wait_for_file(v);
 	return ((fs->seek(v->vdisk.file, blkno * 512, SEEK_ABS) >= 0)
 		&& (fs->write(buf, 512, v->vdisk.file) == 512));
     }
@@ -226,6 +254,50 @@ make_irq(struct vide *v)
 	vpic->simulate_irq(v->vm, v->irq);
 }
 
+/* Start transferring block BLOCK of V's image file to or from V's
+   buffer. The guest sees the controller as busy until the transfer
+   completes, then CALLBACK is called (by the fs-aio task). */
+static void
+start_file_transfer(struct vide *v, int command,
+		    void (*callback)(struct fs_request *))
+{
+    v->status = BUSY_STAT;
+    v->req.file = v->vdisk.file;
+    v->req.buf = v->buf;
+    v->req.len = 512;
+    v->req.offset = v->block * 512;
+    v->req.command = command;
+    v->req.callback = callback;
+    v->req.user_data = v;
+    fs->submit_request(&v->req);
+}
+
+static void
+end_read(struct vide *v, bool ok)
+{
+    if(!ok)
+    {
+	v->error = HD_ERR_UNK;
+	v->status = ERR_STAT;
+    }
+    else
+    {
+	v->status = DATA_RDY_STAT;
+	v->block++;
+	v->blocks_left--;
+	v->buf_index = 0;
+	make_irq(v);
+    }
+}
+
+/* Called by the fs-aio task, end_request() stops it racing with the
+   port handlers of the virtual machine. */
+static void
+read_done(struct fs_request *req)
+{
+    end_read(req->user_data, req->result == 512);
+}
+
 static void
 read_next_block(struct vide *v)
 {
@@ -236,25 +308,40 @@ read_next_block(struct vide *v)
 	v->error = HD_ERR_UNK;
 	v->status = ERR_STAT;
     }
+    else if(v->is_file)
+	start_file_transfer(v, FS_REQ_READ, read_done);
+    else
+	end_read(v, read_one_block(v, v->block, v->buf));
+}
+
+static void
+end_write(struct vide *v, bool ok)
+{
+    if(!ok)
+    {
+	v->error = HD_ERR_BBK;
+	v->status = WERR_STAT;
+    }
     else
     {
-	/* It would be nice to have async I/O here.. */
-	if(!read_one_block(v, v->block, v->buf))
-	{
-	    v->error = HD_ERR_UNK;
-	    v->status = ERR_STAT;
-	}
-	else
+	v->block++;
+	if(--v->blocks_left > 0)
 	{
 	    v->status = DATA_RDY_STAT;
-	    v->block++;
-	    v->blocks_left--;
-	    v->buf_index = 0;
 	    make_irq(v);
 	}
+	else
+	    v->status = RDY_STAT;
+	v->buf_index = 0;
     }
 }
 
+static void
+write_done(struct fs_request *req)
+{
+    end_write(req->user_data, req->result == 512);
+}
+
 static void
 write_block(struct vide *v)
 {
@@ -265,25 +352,10 @@ write_block(struct vide *v)
 	v->error = HD_ERR_UNK;
 	v->status = WERR_STAT;
     }
+    else if(v->is_file)
+	start_file_transfer(v, FS_REQ_WRITE, write_done);
     else
-    {
-	/* It would be nice to have async I/O here.. */
-	if(!write_one_block(v, v->block, v->buf))
-	{
-	    v->error = HD_ERR_BBK;
-	    v->status = WERR_STAT;
-	}
-	else
-	{
-	    v->block++;
-	    if(--v->blocks_left > 0)
-	    {
-		v->status = DATA_RDY_STAT;
-		make_irq(v);
-	    }
-	    v->buf_index = 0;
-	}
-    }
+	end_write(v, write_one_block(v, v->block, v->buf));
 }
 
 static u_long
@@ -298,6 +370,8 @@ vide_in(struct vm *vm, u_short port, int size)
     case HD_DATA:
 	{
 	    u_long val;
+	    if(file_busy_p(v))
+		return (u_long)-1;
 	    switch(size)
 	    {
 	    case 1:
@@ -367,6 +441,8 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
     switch(port)
     {
     case HD_DATA:
+	if(file_busy_p(v))
+	    break;
 	switch(size)
 	{
 	case 1:
@@ -408,6 +484,8 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 	break;
 
     case HD_CURRENT:
+	if(file_busy_p(v))
+	    break;
 	v->select = val;
 	/* Check if they're attempting to select drive 1 (which doesn't
 	   exist). */
@@ -415,6 +493,11 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 	break;
 
     case HD_COMMAND:
+	if(file_busy_p(v))
+	{
+	    kprintf("vide: Command %x while busy ignored, vm=%p\n", val, vm);
+	    break;
+	}
 	v->command = val;
 	switch(val)
 	{
@@ -447,7 +530,9 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 	v->devctrl = val;
 	if(val & HD_SRST)
 	{
-	    /* Reset controlller. */
+	    /* Reset controlller, once the transfer in progress (if any)
+	       has finished with the buffer. */
+	    wait_for_file(v);
 	    v->error = v->num_sectors = v->sector = 0x01;
 	    v->low_cyl = v->high_cyl = v->select = 0x00;
 	    v->status = RDY_STAT;
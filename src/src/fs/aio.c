@@ -0,0 +1,208 @@
+/* aio.c -- Asynchronous file requests.
+
+   A task that can't afford to sleep for a read or write (for example a
+   virtual device, which would stall its whole virtual machine) fills in
+   a struct fs_request and passes it to submit_request(). The request is
+   queued for the fs-aio task, which performs it with read_file() or
+   write_file(), stores the result, calls the request's callback (if it
+   has one) and then signals its semaphore. The submitting task can wait
+   for the request with wait_request() whenever it needs the result.
+
+   The requests are laid out like the block drivers' blkreq_t and owned
+   by the caller in the same way: the fs never allocates or frees them,
+   and a request mustn't be touched (or freed) between its submission and
+   its completion. Requests are performed one at a time in the order they
+   were submitted.
+
+   There are no tasks under Unix, submit_request() performs each request
+   immediately.
+
+   John Harper. */
+
+#include <vmm/fs.h>
+#include <vmm/errno.h>
+#include <vmm/kernel.h>
+
+#ifndef TEST
+# define kprintf kernel->printf
+#endif
+
+static list_t aio_queue;
+
+#ifndef TEST
+static struct task *aio_task;
+static struct semaphore aio_work;	/* signalled when AIO-QUEUE changes */
+#endif
+
+/* Perform the request REQ in the current task. */
+static void
+do_request(struct fs_request *req)
+{
+    if((req->offset != FS_REQ_CUR_POS)
+       && (seek_file(req->file, req->offset, SEEK_ABS) < 0))
+    {
+	req->result = -ERRNO;
+    }
+    else if(req->command == FS_REQ_READ)
+	req->result = read_file(req->buf, req->len, req->file);
+    else
+	req->result = write_file(req->buf, req->len, req->file);
+}
+
+/* Call REQ's callback, then mark it as finished and wake up anyone
+   waiting for it. This is done without being pre-empted: once COMPLETED
+   is set the owner of REQ may submit it again or free it, so REQ mustn't
+   be touched afterwards. */
+static void
+end_request(struct fs_request *req)
+{
+    FORBID();
+    if(req->callback != NULL)
+	req->callback(req);
+    req->completed = TRUE;
+    signal(&req->sem);
+    PERMIT();
+}
+
+#ifndef TEST
+/* The fs-aio task. Performs queued requests in order. */
+static void
+aio_main(void)
+{
+    while(1)
+    {
+	struct fs_request *req;
+	wait(&aio_work);
+	while(1)
+	{
+	    FORBID();
+	    if(list_empty_p(&aio_queue))
+		req = NULL;
+	    else
+	    {
+		req = (struct fs_request *)aio_queue.head;
+		remove_node(&req->node);
+	    }
+	    PERMIT();
+	    if(req == NULL)
+		break;
+	    do_request(req);
+	    end_request(req);
+	}
+    }
+}
+#endif
+
+void
+init_aio(void)
+{
+    init_list(&aio_queue);
+#ifndef TEST
+    set_sem_blocked(&aio_work);
+    aio_task = kernel->add_task(aio_main, TASK_RUNNING, 0, "fs-aio");
+    if(aio_task == NULL)
+	kprintf("fs: Can't start fs-aio task\n");
+#endif
+}
+
+/* Abort any requests still queued and stop the fs-aio task. */
+void
+kill_aio(void)
+{
+#ifndef TEST
+    if(aio_task != NULL)
+    {
+	kernel->kill_task(aio_task);
+	aio_task = NULL;
+    }
+#endif
+    FORBID();
+    while(!list_empty_p(&aio_queue))
+    {
+	struct fs_request *req = (struct fs_request *)aio_queue.head;
+	remove_node(&req->node);
+	req->result = -E_INVALID;
+	end_request(req);
+    }
+    PERMIT();
+}
+
+/* Queue the request REQ. The caller must have set its FILE, BUF, LEN,
+   OFFSET, COMMAND and CALLBACK fields. Returns FALSE if REQ is invalid
+   (its COMPLETED field is then TRUE and RESULT the error). */
+bool
+submit_request(struct fs_request *req)
+{
+    set_sem_blocked(&req->sem);
+    req->completed = FALSE;
+    req->result = 0;
+    if((req->file == NULL)
+       || ((req->command != FS_REQ_READ) && (req->command != FS_REQ_WRITE)))
+	ERRNO = E_BADARG;
+    else if(!(req->file->mode & ((req->command == FS_REQ_READ)
+				 ? F_READ : F_WRITE)))
+	ERRNO = E_PERM;
+    else
+	ERRNO = E_OK;
+    if(ERRNO != E_OK)
+    {
+	req->result = -ERRNO;
+	end_request(req);
+	return FALSE;
+    }
+#ifndef TEST
+    if(aio_task != NULL)
+    {
+	FORBID();
+	append_node(&aio_queue, &req->node);
+	PERMIT();
+	signal(&aio_work);
+	return TRUE;
+    }
+#endif
+    /* No fs-aio task, do it now. */
+    do_request(req);
+    end_request(req);
+    return TRUE;
+}
+
+/* Sleep until the request REQ has completed, then return its result:
+   the number of bytes transferred or a negative error code. */
+long
+wait_request(struct fs_request *req)
+{
+    if(!req->completed)
+	wait(&req->sem);
+    return req->result;
+}
+
+/* Remove the request REQ from the queue if it hasn't been started yet,
+   completing it with the error E_INVALID. Returns FALSE if REQ has been
+   started, the caller should then wait for it to finish. */
+bool
+cancel_request(struct fs_request *req)
+{
+    bool queued = FALSE;
+    FORBID();
+    if(!req->completed)
+    {
+	list_node_t *x = aio_queue.head;
+	while(x->succ != NULL)
+	{
+	    if(x == &req->node)
+	    {
+		remove_node(x);
+		queued = TRUE;
+		break;
+	    }
+	    x = x->succ;
+	}
+    }
+    PERMIT();
+    if(queued)
+    {
+	req->result = -E_INVALID;
+	end_request(req);
+    }
+    return queued || req->completed;
+}
@@ -3,15 +3,352 @@
 
 #include <vmm/fs.h>
 #include <vmm/errno.h>
+#include <vmm/string.h>
 #include <vmm/bits.h>
 #include <vmm/io.h>
 #include <vmm/kernel.h>
 #ifndef TEST
 # define kprintf kernel->printf
+# define malloc kernel->malloc
+# define free kernel->free
 #endif
 
+#define BITS_PER_BLOCK (FS_BLKSIZ * 8)
+
 
-/* Generic disk-block-based bitmap handling. */
+/* Generic disk-block-based bitmap handling.
+
+   The data and inode bitmaps of each device have a `struct bmap_info'
+   in the fs_device. It records the number of free bits in each of the
+   bitmap's blocks (or -1 if it isn't known yet, the count is made the
+   first time the block is read), so the allocator can skip full blocks
+   without reading them, and the total number of free bits once all the
+   blocks have been counted (see bmap_count_free()). It also records a
+   rotor, the bit after the one last allocated, where searches without a
+   goal start. */
+
+/* Set up the bitmap summaries of DEV after its super block was read. */
+void
+init_bmap_info(struct fs_device *dev)
+{
+    struct bmap_info *info[2];
+    int i;
+    free_bmap_info(dev);
+    dev->data_bmap.start = dev->sup.data_bitmap;
+    dev->data_bmap.len = dev->sup.data_size;
+    dev->inode_bmap.start = dev->sup.inode_bitmap;
+    dev->inode_bmap.len = dev->sup.num_inodes;
+    info[0] = &dev->data_bmap;
+    info[1] = &dev->inode_bmap;
+    for(i = 0; i < 2; i++)
+    {
+	info[i]->nr_blocks = ((info[i]->len + BITS_PER_BLOCK - 1)
+			      / BITS_PER_BLOCK);
+	info[i]->rotor = 0;
+	info[i]->nr_free = -1;
+	info[i]->block_free = malloc(info[i]->nr_blocks * sizeof(short));
+	if(info[i]->block_free != NULL)
+	    memset(info[i]->block_free, -1, info[i]->nr_blocks * sizeof(short));
+    }
+}
+
+/* Discard the bitmap summaries of DEV. */
+void
+free_bmap_info(struct fs_device *dev)
+{
+    if(dev->data_bmap.block_free != NULL)
+    {
+	free(dev->data_bmap.block_free);
+	dev->data_bmap.block_free = NULL;
+    }
+    if(dev->inode_bmap.block_free != NULL)
+    {
+	free(dev->inode_bmap.block_free);
+	dev->inode_bmap.block_free = NULL;
+    }
+}
+
+/* Return the summary of the bitmap starting at block BMAP-START of DEV,
+   or NULL if it doesn't have one. */
+static inline struct bmap_info *
+get_bmap_info(struct fs_device *dev, blkno bmap_start)
+{
+    if(bmap_start == dev->data_bmap.start)
+	return &dev->data_bmap;
+    if(bmap_start == dev->inode_bmap.start)
+	return &dev->inode_bmap;
+    return NULL;
+}
+
+/* Return the number of clear bits in the first LEN bits of BMAP. */
+static int
+count_free_bits(u_long *bmap, int len)
+{
+    int i, count = 0;
+    for(i = 0; i < len; i += 32)
+    {
+	u_long word = bmap[i / 32];
+	if(word == 0xffffffff)
+	    continue;
+	if((word == 0) && (i + 32 <= len))
+	    count += 32;
+	else
+	{
+	    int j;
+	    for(j = i; (j < i + 32) && (j < len); j++)
+	    {
+		if(!test_bit(bmap, j))
+		    count++;
+	    }
+	}
+    }
+    return count;
+}
+
+/* Return the number of clear bits in BMAP starting at bit BIT, counting
+   no further than bit LEN or MAX bits. */
+static int
+free_run_length(u_long *bmap, int bit, int len, int max)
+{
+    int n = 0;
+    while((n < max) && (bit + n < len) && !test_bit(bmap, bit + n))
+	n++;
+    return n;
+}
+
+/* Find a run of WANT clear bits in the first LEN bits of BMAP, as near to
+   bit FROM as possible: runs starting at or after FROM are tried in order,
+   then those before it working backwards. If there's no run that long
+   the longest one is used. Returns the first bit of the run and stores
+   its length (at most WANT) in *LENP, or returns -1 if every bit is
+   set. */
+static int
+find_free_run(u_long *bmap, int len, int from, int want, int *lenp)
+{
+    int bit = from, best = -1, best_len = 0;
+    while(bit < len)
+    {
+	int run;
+	if(((bit % 32) == 0) && (bmap[bit / 32] == 0xffffffff))
+	{
+	    bit += 32;
+	    continue;
+	}
+	run = free_run_length(bmap, bit, len, want);
+	if(run >= want)
+	{
+	    *lenp = run;
+	    return bit;
+	}
+	if(run > best_len)
+	{
+	    best = bit;
+	    best_len = run;
+	}
+	bit += run + 1;
+    }
+    bit = min(from, len) - 1;
+    while(bit >= 0)
+    {
+	int first;
+	if(((bit % 32) == 31) && (bmap[bit / 32] == 0xffffffff))
+	{
+	    bit -= 32;
+	    continue;
+	}
+	if(test_bit(bmap, bit))
+	{
+	    bit--;
+	    continue;
+	}
+	/* BIT is the last of a free run, find its first bit. */
+	first = bit;
+	while((first > 0) && !test_bit(bmap, first - 1))
+	    first--;
+	if(bit - first + 1 >= want)
+	{
+	    /* Use the end nearest FROM. */
+	    *lenp = want;
+	    return bit - want + 1;
+	}
+	if(bit - first + 1 > best_len)
+	{
+	    best = first;
+	    best_len = bit - first + 1;
+	}
+	bit = first - 2;
+    }
+    *lenp = best_len;
+    return best;
+}
+
+/* Allocate a run of up to *COUNTP clear bits from block INDEX of the
+   bitmap INFO, which has LEN bits, as near to bit FROM of the block as
+   possible (see find_free_run()). If WHOLE is TRUE only a run of all
+   *COUNTP bits will do. *COUNTP is set to the number of bits actually
+   allocated. Returns the first bit number in the block, -1 if there's no
+   suitable run or -2 if the block couldn't be read. */
+static int
+alloc_from_block(struct fs_device *dev, blkno bmap_start, u_long bmap_len,
+		 struct bmap_info *info, u_long index, int from,
+		 u_long *countp, bool whole)
+{
+    struct buf_head *buf;
+    int len, bit = -1, count = 0;
+    buf = bread_class(dev, bmap_start + index, BUF_CLASS_BITMAP);
+    if(buf == NULL)
+	return -2;
+    len = min(bmap_len - (index * BITS_PER_BLOCK), BITS_PER_BLOCK);
+    FORBID();
+    if((info != NULL) && (info->block_free != NULL)
+       && (info->block_free[index] < 0))
+	info->block_free[index] = count_free_bits(buf->buf->bmap, len);
+    if((info == NULL) || (info->block_free == NULL)
+       || (info->block_free[index] >= (whole ? *countp : 1)))
+    {
+	bit = find_free_run(buf->buf->bmap, len, min(from, len),
+			    min(*countp, BITS_PER_BLOCK), &count);
+	if((bit != -1) && whole && (count < *countp))
+	    bit = -1;
+	if(bit != -1)
+	{
+	    int i;
+	    for(i = 0; i < count; i++)
+		set_bit(buf->buf->bmap, bit + i);
+	    if((info != NULL) && (info->block_free != NULL))
+		info->block_free[index] -= count;
+	    if((info != NULL) && (info->nr_free >= 0))
+		info->nr_free -= count;
+	}
+    }
+    PERMIT();
+    *countp = (bit != -1) ? count : 0;
+    if(bit != -1)
+	journal_dirty(buf);
+    brelse(buf);
+    return bit;
+}
+
+/* Return the number of clear bits in the bitmap INFO of device DEV, or -1
+   if an error occurs. The first call reads any of the bitmap's blocks
+   that haven't been counted yet, after that the count is kept up to date
+   by the allocator and this is O(1). */
+long
+bmap_count_free(struct fs_device *dev, struct bmap_info *info)
+{
+    long total = 0;
+    u_long i;
+    if(info->nr_free >= 0)
+	return info->nr_free;
+    for(i = 0; i < info->nr_blocks; i++)
+    {
+	if((info->block_free == NULL) || (info->block_free[i] < 0))
+	{
+	    int count;
+	    struct buf_head *buf = bread_class(dev, info->start + i,
+					       BUF_CLASS_BITMAP);
+	    if(buf == NULL)
+		return -1;
+	    FORBID();
+	    count = count_free_bits(buf->buf->bmap,
+				    min(info->len - (i * BITS_PER_BLOCK),
+					BITS_PER_BLOCK));
+	    if(info->block_free != NULL)
+		info->block_free[i] = count;
+	    PERMIT();
+	    brelse(buf);
+	    total += count;
+	}
+    }
+    if(info->block_free == NULL)
+	return total;
+    /* Blocks counted earlier may have changed while we were reading,
+       so add up the per-block counts again now that they're all known. */
+    FORBID();
+    if(info->nr_free < 0)
+    {
+	total = 0;
+	for(i = 0; i < info->nr_blocks; i++)
+	    total += info->block_free[i];
+	info->nr_free = total;
+    }
+    PERMIT();
+    return info->nr_free;
+}
+
+/* Find a run of free entities in the bitmap starting at block BMAP-START
+   on device DEV which contains BMAP-LEN bits, as close to bit GOAL as
+   possible. Bitmap blocks are searched outwards from the one containing
+   GOAL, first for a run of all *COUNTP bits, then (if there isn't one
+   anywhere) for the longest run in the nearest block with any free bits.
+   The number of bits actually allocated (at least one) is stored in
+   *COUNTP. Returns the number of the first bit, or -1 if an error or all
+   bits are set. */
+long
+bmap_alloc_run(struct fs_device *dev, blkno bmap_start, u_long bmap_len,
+	       u_long goal, u_long *countp)
+{
+    struct bmap_info *info = get_bmap_info(dev, bmap_start);
+    long nr_blocks = (bmap_len + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    long first, dist;
+    int pass;
+    if(goal >= bmap_len)
+	goal = 0;
+    first = goal / BITS_PER_BLOCK;
+    for(pass = (*countp > 1) ? 0 : 1; pass < 2; pass++)
+    {
+	bool whole = (pass == 0);
+	for(dist = 0; (first - dist >= 0) || (first + dist < nr_blocks);
+	    dist++)
+	{
+	    long index[2];
+	    u_long count;
+	    int i;
+	    index[0] = first + dist;
+	    index[1] = (dist > 0) ? first - dist : -1;
+	    for(i = 0; i < 2; i++)
+	    {
+		int bit, from;
+		if((index[i] < 0) || (index[i] >= nr_blocks))
+		    continue;
+		if((info != NULL) && (info->block_free != NULL)
+		   && (info->block_free[index[i]] >= 0)
+		   && (info->block_free[index[i]] < (whole ? *countp : 1)))
+		    continue;
+		/* Blocks after GOAL's are searched from their start,
+		   those before it from their end. */
+		if(index[i] == first)
+		    from = goal % BITS_PER_BLOCK;
+		else
+		    from = (index[i] > first) ? 0 : BITS_PER_BLOCK;
+		count = *countp;
+		bit = alloc_from_block(dev, bmap_start, bmap_len, info,
+				       index[i], from, &count, whole);
+		if(bit == -2)
+		    return -1;
+		if(bit >= 0)
+		{
+		    long result = (index[i] * BITS_PER_BLOCK) + bit;
+		    if(info != NULL)
+			info->rotor = result + count;
+		    *countp = count;
+		    return result;
+		}
+	    }
+	}
+    }
+    ERRNO = E_NOSPC;
+    return -1;
+}
+
+/* Like bmap_alloc_run() but allocates a single bit. */
+long
+bmap_alloc_near(struct fs_device *dev, blkno bmap_start, u_long bmap_len,
+		u_long goal)
+{
+    u_long count = 1;
+    return bmap_alloc_run(dev, bmap_start, bmap_len, goal, &count);
+}
 
 /* Find a free entity in the bitmap starting at block BMAP-START on device
    DEV which contains BMAP-LEN bits. Sets the free bit it finds then returns
@@ -19,31 +356,55 @@
 long
 bmap_alloc(struct fs_device *dev, blkno bmap_start, u_long bmap_len)
 {
-    blkno bmap_blk = bmap_start;
-    while(bmap_len > 0)
+    struct bmap_info *info = get_bmap_info(dev, bmap_start);
+    return bmap_alloc_near(dev, bmap_start, bmap_len,
+			   (info != NULL) ? info->rotor : 0);
+}
+
+/* Clear the COUNT bits from bit number BIT of the bitmap starting at block
+   BMAP-START of device DEV, each bitmap block is written once. Return TRUE
+   if no errors occurred. */
+bool
+bmap_free_run(struct fs_device *dev, blkno bmap_start, u_long bit,
+	      u_long count)
+{
+    struct bmap_info *info = get_bmap_info(dev, bmap_start);
+    while(count > 0)
     {
-	int len, bit;
-	struct buf_head *buf = bread(dev, bmap_blk);
+	blkno bmap_blk = (bit / BITS_PER_BLOCK) + bmap_start;
+	struct buf_head *buf = bread_class(dev, bmap_blk, BUF_CLASS_BITMAP);
+	int freed = 0;
 	if(buf == NULL)
-	    return -1;
-	len = min(bmap_len, FS_BLKSIZ * 8);
+	    return FALSE;
 	FORBID();
-	bit = find_zero_bit(buf->buf.bmap, len);
-	if(bit != -1)
+	do {
+	    int this = bit % BITS_PER_BLOCK;
+	    if(!test_bit(buf->buf->bmap, this))
+	    {
+		kprintf("fs: Oops, freeing a free bit (%u) in bitmap %u\n",
+			this, bmap_start);
+	    }
+	    else
+	    {
+		clear_bit(buf->buf->bmap, this);
+		freed++;
+	    }
+	    bit++;
+	    count--;
+	} while((count > 0) && ((bit % BITS_PER_BLOCK) != 0));
+	if((info != NULL) && (info->block_free != NULL)
+	   && (info->block_free[bmap_blk - bmap_start] >= 0))
 	{
-	    set_bit(buf->buf.bmap, bit);
-	    PERMIT();
-	    bdirty(buf, TRUE);
-	    brelse(buf);
-	    return ((bmap_blk - bmap_start) * FS_BLKSIZ * 8) + bit;
+	    info->block_free[bmap_blk - bmap_start] += freed;
 	}
+	if((info != NULL) && (info->nr_free >= 0))
+	    info->nr_free += freed;
 	PERMIT();
+	if(freed > 0)
+	    journal_dirty(buf);
 	brelse(buf);
-	bmap_len -= len;
-	bmap_blk++;
     }
-    ERRNO = E_NOSPC;
-    return -1;
+    return TRUE;
 }
 
 /* Mark the entity at bit number BIT of the bitmap starting at block
@@ -51,71 +412,190 @@ bmap_alloc(struct fs_device *dev, blkno bmap_start, u_long bmap_len)
 bool
 bmap_free(struct fs_device *dev, blkno bmap_start, u_long bit)
 {
-    blkno bmap_blk = (bit / (FS_BLKSIZ * 8)) + bmap_start;
-    struct buf_head *buf = bread(dev, bmap_blk);
-    if(buf == NULL)
-	return FALSE;
-    bit = bit % (FS_BLKSIZ * 8);
-    if(!test_bit(buf->buf.bmap, bit))
-    {
-	kprintf("fs: Oops, freeing a free bit (%u) in bitmap %u\n",
-		bit, bmap_start);
-    }
-    else
-    {
-	clear_bit(buf->buf.bmap, bit);
-	bdirty(buf, TRUE);
-    }
-    brelse(buf);
-    return TRUE;
+    return bmap_free_run(dev, bmap_start, bit, 1);
 }
 
 
 /* Data-block bitmap handling. */
 
+/* Allocate a run of up to *COUNTP contiguous blocks from DEV, as close
+   to LOCALITY as possible (see alloc_block()). The number of blocks
+   actually allocated is stored in *COUNTP, the first block of the run is
+   returned, or zero if no blocks are free. */
+blkno
+alloc_blocks(struct fs_device *dev, blkno locality, u_long *countp)
+{
+    long blk;
+    u_long goal;
+    if((locality >= dev->sup.data)
+       && (locality < dev->sup.data + dev->sup.data_size))
+	goal = locality - dev->sup.data + 1;
+    else
+	goal = dev->data_bmap.rotor;
+    blk = bmap_alloc_run(dev, dev->sup.data_bitmap, dev->sup.data_size,
+			 goal, countp);
+    return (blk == -1) ? 0 : dev->sup.data + blk;
+}
+
 /* Allocate a new block from DEV's bitmap. LOCALITY is where you want the
-   new block to be close to. Note that LOCALITY is ignored for now... */
+   new block to be close to, the block after it is used if it's free. If
+   LOCALITY is zero the search starts after the last block allocated. */
 blkno
 alloc_block(struct fs_device *dev, blkno locality)
 {
-    blkno blk = bmap_alloc(dev, dev->sup.data_bitmap, dev->sup.data_size);
-    return (blk == -1) ? 0 : dev->sup.data + blk;
+    u_long count = 1;
+    return alloc_blocks(dev, locality, &count);
+}
+
+/* Block reference counts.
+
+   On devices with the FS_FEAT_REFCOUNT feature each data block has a
+   byte in the reference count table (between the data bitmap and the
+   log) holding the number of files sharing the block besides the first.
+   Blocks are shared by clone_file(). Freeing a shared block only drops a
+   reference, and a file writing to a shared block is given its own copy
+   of it first (see unshare_block() in inode.c). */
+
+#define MAX_BLOCK_REFS 255
+
+/* Returns the buffer holding the reference count of data block BLK of
+   DEV, the count's offset in it is stored in *INDEXP. */
+static inline struct buf_head *
+refcount_block(struct fs_device *dev, blkno blk, u_long *indexp)
+{
+    u_long n = blk - dev->sup.data;
+    *indexp = n % FS_BLKSIZ;
+    return bread_class(dev, dev->refcount_start + (n / FS_BLKSIZ),
+		       BUF_CLASS_BITMAP);
+}
+
+/* Returns the number of files sharing data block BLK of DEV besides its
+   first owner, or -1 if an error occurs. */
+long
+block_refs(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *buf;
+    u_long index;
+    long refs;
+    if(!(dev->features & FS_FEAT_REFCOUNT))
+	return 0;
+    buf = refcount_block(dev, blk, &index);
+    if(buf == NULL)
+	return -1;
+    refs = buf->buf->data[index];
+    brelse(buf);
+    return refs;
+}
+
+/* Add a reference to data block BLK of DEV, another file is about to
+   share it. */
+bool
+share_block(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *buf;
+    u_long index;
+    bool rc = FALSE;
+    if(!(dev->features & FS_FEAT_REFCOUNT))
+    {
+	ERRNO = E_BADARG;
+	return FALSE;
+    }
+    buf = refcount_block(dev, blk, &index);
+    if(buf == NULL)
+	return FALSE;
+    FORBID();
+    if(buf->buf->data[index] < MAX_BLOCK_REFS)
+    {
+	buf->buf->data[index]++;
+	rc = TRUE;
+    }
+    PERMIT();
+    if(rc)
+	journal_dirty(buf);
+    else
+	ERRNO = E_MAXLINKS;
+    brelse(buf);
+    return rc;
+}
+
+/* If data block BLK of DEV is shared drop one reference to it and return
+   1, otherwise return 0 (or -1 if an error occurs). */
+static int
+unshare_ref(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *buf;
+    u_long index;
+    int shared;
+    if(!(dev->features & FS_FEAT_REFCOUNT))
+	return 0;
+    buf = refcount_block(dev, blk, &index);
+    if(buf == NULL)
+	return -1;
+    FORBID();
+    shared = (buf->buf->data[index] > 0);
+    if(shared)
+	buf->buf->data[index]--;
+    PERMIT();
+    if(shared)
+	journal_dirty(buf);
+    brelse(buf);
+    return shared;
 }
 
 /* Deallocate the block BLK from DEV. */
 bool
 free_block(struct fs_device *dev, blkno blk)
 {
-    return bmap_free(dev, dev->sup.data_bitmap, blk - dev->sup.data);
+    return free_blocks(dev, blk, 1);
 }
 
-
-/* Returns the total number of used blocks in the device DEV. This takes
-   into account the boot-block, inode-blocks and the bitmap-blocks. */
-u_long
-used_blocks(struct fs_device *dev)
+/* Deallocate the COUNT blocks starting at BLK from DEV. Blocks that are
+   shared with other files just lose a reference. */
+bool
+free_blocks(struct fs_device *dev, blkno blk, u_long count)
 {
-    u_long total = 0;
-    blkno bmap_blk = dev->sup.data_bitmap;
-    u_long bmap_len = dev->sup.data_size;	/* in bits */
-    while(bmap_len > 0)
+    while(count > 0)
     {
-	int i, len;
-	struct buf_head *buf = bread(dev, bmap_blk);
-	if(buf == NULL)
-	    return 0;
-	len = min(bmap_len, FS_BLKSIZ * 8);
-	for(i = 0; i < len; i ++)
+	u_long n = 0;
+	int shared = 0;
+	while((n < count) && ((shared = unshare_ref(dev, blk + n)) == 0))
+	    n++;
+	if(shared < 0)
+	    return FALSE;
+	if(n > 0)
 	{
-	    if(test_bit(buf->buf.bmap, i))
-		total++;
+	    journal_forget(dev, blk, n);
+	    if(!bmap_free_run(dev, dev->sup.data_bitmap, blk - dev->sup.data,
+			      n))
+		return FALSE;
 	}
-	brelse(buf);
-	bmap_len -= len;
-	bmap_blk++;
+	if(n < count)
+	    n++;			/* the shared block */
+	blk += n;
+	count -= n;
     }
-    return (total + 1
-	    + (dev->sup.num_inodes / (FS_BLKSIZ * 8))
-	    + (dev->sup.num_inodes / INODES_PER_BLOCK)
-	    + (dev->sup.data_size / (FS_BLKSIZ * 8)));
+    return TRUE;
+}
+
+
+/* Returns the total number of used blocks in the device DEV. Everything
+   before the data blocks (the boot-block, bitmaps, inode-blocks, reference
+   counts and log) counts as used. */
+u_long
+used_blocks(struct fs_device *dev)
+{
+    long free_blocks = bmap_count_free(dev, &dev->data_bmap);
+    if(free_blocks < 0)
+	return 0;
+    return dev->sup.data + (dev->sup.data_size - free_blocks);
+}
+
+/* Returns the number of inodes in use on the device DEV. */
+u_long
+used_inodes(struct fs_device *dev)
+{
+    long free_inodes = bmap_count_free(dev, &dev->inode_bmap);
+    if(free_inodes < 0)
+	return 0;
+    return dev->sup.num_inodes - free_inodes;
 }
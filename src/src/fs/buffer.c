@@ -4,184 +4,1065 @@
 #include <vmm/fs.h>
 #include <vmm/errno.h>
 #include <vmm/kernel.h>
+#include <vmm/string.h>
 #include <vmm/io.h>
+#include <vmm/time.h>
+#include <vmm/tasks.h>
 
 #ifndef TEST
 # define kprintf kernel->printf
+# define malloc kernel->malloc
+# define free kernel->free
+# define alloc_page kernel->alloc_page
+# define free_page kernel->free_page
+# define free_page_count kernel->free_page_count
+# define get_timer_ticks kernel->get_timer_ticks
+#else
+/* There's no page allocator when testing under Unix, pretend that there's
+   enough memory for TEST_BUF_PAGES pages of buffers. */
+# define TEST_BUF_PAGES 64
+# define alloc_page() ((page *)malloc(PAGE_SIZE))
+# define free_page(p) free(p)
+# define free_page_count() (BUF_FREE_RESERVE + TEST_BUF_PAGES - buf_pages)
 #endif
 
 
-static list_t buffer_table[BUFFER_BUCKETS];
-static struct buf_head *bh_free_list;
-static struct buf_head buffer_pool[NR_BUFFERS];
+/* Each page of buffer memory has one of these. The buffer heads live
+   here, the block data lives in the page itself. */
+struct buf_page {
+    struct buf_page *next;
+    page *data;
+    struct buf_head bufs[BUFS_PER_PAGE];
+};
 
-/* Some simple statistics. */
-u_long total_accessed, cached_accesses, dirty_accesses;
+static struct buf_page *buf_page_list;	/* pages holding buffers */
+static struct buf_page *spare_buf_pages; /* headers whose page was freed */
+static u_long buf_pages;
+
+/* Hash table of cached buffers, indexed by BUFFER_HASH(). The chains are
+   linked through the `hash_next' field. */
+static struct buf_head **buffer_hash;
+static u_long buffer_hash_mask;
+
+/* Unused buffers are in buffer_lists[BUF_FREE], cached buffers are in
+   either the BUF_INACTIVE or BUF_ACTIVE lists, most recently used first.
+   Buffers are always evicted from the tail of the inactive list if
+   possible. */
+static list_t buffer_lists[BUF_NR_LISTS];
+static u_long buffer_list_len[BUF_NR_LISTS];
+
+/* The number of cached buffers of each class. */
+static u_long buffer_class_len[BUF_NR_CLASSES];
+
+/* The page allocator may call buffer_shrinker() at any time (even from an
+   interrupt), so it has to know when a task is in the middle of changing
+   the cache's lists. */
+static int cache_busy;
+#define LOCK_CACHE()	do { FORBID(); cache_busy++; } while(0)
+#define UNLOCK_CACHE()	do { cache_busy--; PERMIT(); } while(0)
+
+/* Tasks which don't find a block in the cache lock its bucket, one of
+   BUFFER_LOCKS semaphores chosen by BUFFER_LOCK(), while they find a free
+   buffer for it. This stops two tasks adding the same block without
+   stopping any other task using the cache. Once the block's been added
+   its buffer's `locked' flag makes other tasks wanting it wait until it
+   has been read. */
+#ifndef TEST
+static struct semaphore bucket_locks[BUFFER_LOCKS];
+#endif
+
+static u_long nr_buffers, buffer_hash_size;
+
+/* Statistics, see get_buffer_stats(). */
+struct buffer_stats buf_stats;
+
+/* bread_ahead() reads runs of blocks into this buffer then copies them
+   into the cache. RA-BUSY is set while it's in use. */
+static u_char *ra_buffer;
+static bool ra_busy;
+
+/* Write-back settings, see the BDFLUSH_ definitions in <vmm/fs.h>. These
+   may be changed by the `bdflush' shell command. */
+u_long bdflush_interval = BDFLUSH_INTERVAL;
+u_long bdflush_age = BDFLUSH_AGE;
+u_long bdflush_ratio = BDFLUSH_RATIO;
+u_long bdflush_limit = BDFLUSH_LIMIT;
+static u_long nr_dirty_buffers;
+
+/* write_buffer() copies runs of dirty blocks into this buffer so that
+   they can be written by a single request. WB-BUSY is set while it's
+   being used. */
+static u_char *wb_buffer;
+static bool wb_busy;
 
 static bool handle_device_error(struct buf_head *bh, int access_type);
+static u_long buffer_shrinker(u_long count);
+
+#ifndef TEST
+static struct page_shrinker shrinker = { NULL, buffer_shrinker };
+static struct task *bdflush_task;
+#else
+/* There's no bdflush task under Unix, brelse() calls flush_buffers()
+   every bdflush_interval ticks instead. */
+static u_long last_flush;
+#endif
+
+
+/* Hash table handling. */
+
+static inline void
+hash_buffer(struct buf_head *bh)
+{
+    struct buf_head **chain = &buffer_hash[BUFFER_HASH(bh->dev, bh->blkno,
+						       buffer_hash_mask)];
+    bh->hash_next = *chain;
+    *chain = bh;
+}
+
+/* This is only called when BH is leaving the cache. */
+static inline void
+unhash_buffer(struct buf_head *bh)
+{
+    struct buf_head **x = &buffer_hash[BUFFER_HASH(bh->dev, bh->blkno,
+						   buffer_hash_mask)];
+    buffer_class_len[(int)bh->type]--;
+    while(*x != NULL)
+    {
+	if(*x == bh)
+	{
+	    *x = bh->hash_next;
+	    break;
+	}
+	x = &(*x)->hash_next;
+    }
+    bh->hash_next = NULL;
+}
+
+/* Rebuild the hash table so that it has SIZE chains (a power of two).
+   Returns FALSE if there isn't enough memory, in which case the old
+   table is left alone. This should be called in the middle of a
+   LOCK_CACHE(). */
+static bool
+resize_hash(u_long size)
+{
+    struct buf_head **new_hash, **old_hash = buffer_hash;
+    u_long i, old_size = buffer_hash_size;
+    new_hash = malloc(size * sizeof(struct buf_head *));
+    if(new_hash == NULL)
+	return FALSE;
+    memset(new_hash, 0, size * sizeof(struct buf_head *));
+    buffer_hash = new_hash;
+    buffer_hash_size = size;
+    buffer_hash_mask = size - 1;
+    for(i = 0; i < old_size; i++)
+    {
+	struct buf_head *x = old_hash[i];
+	while(x != NULL)
+	{
+	    struct buf_head *nxt = x->hash_next;
+	    hash_buffer(x);
+	    x = nxt;
+	}
+    }
+    if(old_hash != NULL)
+	free(old_hash);
+    return TRUE;
+}
+
+/* This should be called in the middle of a LOCK_CACHE(). */
+static inline struct buf_head *
+find_buffer(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *x = buffer_hash[BUFFER_HASH(dev, blk, buffer_hash_mask)];
+    while(x != NULL)
+    {
+	if((x->blkno == blk) && (x->dev == dev) && !x->invalid)
+	    return x;
+	x = x->hash_next;
+    }
+    return NULL;
+}
+
+
+/* Statistics. */
 
+/* Account for a device read which was started at START ticks. */
+static inline void
+note_read_latency(u_long start)
+{
+    u_long ticks = get_timer_ticks() - start;
+    int i = 0;
+    while((ticks > 0) && (i < BUF_LATENCY_BUCKETS - 1))
+    {
+	ticks >>= 1;
+	i++;
+    }
+    buf_stats.read_latency[i]++;
+}
+
+/* Fill in STATS with a snapshot of the buffer cache's statistics. */
 void
-init_buffers(void)
+get_buffer_stats(struct buffer_stats *stats)
+{
+    struct buf_page *bp;
+    u_long now = get_timer_ticks();
+    FORBID();
+    memcpy(stats, &buf_stats, sizeof(struct buffer_stats));
+    stats->nr_buffers = nr_buffers;
+    stats->hash_size = buffer_hash_size;
+    memcpy(stats->list_len, buffer_list_len, sizeof(buffer_list_len));
+    memcpy(stats->class_len, buffer_class_len, sizeof(buffer_class_len));
+    stats->nr_dirty = nr_dirty_buffers;
+    stats->dirty_age_total = stats->dirty_age_max = 0;
+    for(bp = buf_page_list; bp != NULL; bp = bp->next)
+    {
+	int i;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
+	{
+	    struct buf_head *x = &bp->bufs[i];
+	    if(x->dirty)
+	    {
+		u_long age = now - x->dirty_time;
+		stats->dirty_age_total += age;
+		if(age > stats->dirty_age_max)
+		    stats->dirty_age_max = age;
+	    }
+	}
+    }
+    PERMIT();
+}
+
+/* Fill in STATS with a snapshot of the statistics of device DEV. */
+void
+get_device_stats(struct fs_device *dev, struct fs_dev_stats *stats)
+{
+    FORBID();
+    memcpy(stats, &dev->stats, sizeof(struct fs_dev_stats));
+    PERMIT();
+}
+
+
+/* Bucket locks. */
+
+/* Account for a task having waited for a lock since START ticks. */
+static inline void
+note_lock_wait(u_long start)
+{
+    u_long wait = get_timer_ticks() - start;
+    buf_stats.lock_wait_total += wait;
+    if(wait > buf_stats.lock_wait_max)
+	buf_stats.lock_wait_max = wait;
+}
+
+/* Returns TRUE if another task holds the bucket lock of block BLK of
+   device DEV. */
+static inline bool
+bucket_locked_p(struct fs_device *dev, blkno blk)
+{
+#ifndef TEST
+    return bucket_locks[BUFFER_LOCK(dev, blk)].blocked;
+#else
+    return FALSE;
+#endif
+}
+
+/* Take the bucket lock of block BLK of device DEV, sleeping until it's
+   available. Returns the time at which it was taken, this should be
+   passed to unlock_bucket(). */
+static inline u_long
+lock_bucket(struct fs_device *dev, blkno blk)
+{
+    u_long start = get_timer_ticks();
+#ifndef TEST
+    if(bucket_locked_p(dev, blk))
+    {
+	buf_stats.bucket_lock_waits++;
+	wait(&bucket_locks[BUFFER_LOCK(dev, blk)]);
+	note_lock_wait(start);
+	start = get_timer_ticks();
+    }
+    else
+	wait(&bucket_locks[BUFFER_LOCK(dev, blk)]);
+#endif
+    buf_stats.bucket_locks_taken++;
+    return start;
+}
+
+static inline void
+unlock_bucket(struct fs_device *dev, blkno blk, u_long locked_at)
+{
+    u_long held = get_timer_ticks() - locked_at;
+    buf_stats.lock_hold_total += held;
+    if(held > buf_stats.lock_hold_max)
+	buf_stats.lock_hold_max = held;
+#ifndef TEST
+    signal(&bucket_locks[BUFFER_LOCK(dev, blk)]);
+#endif
+}
+
+
+/* Replacement lists. */
+
+/* Move the buffer X to the head of the list WHICH. */
+static inline void
+move_buffer(struct buf_head *x, int which)
+{
+    remove_node(&x->node);
+    buffer_list_len[(int)x->lru]--;
+    x->lru = which;
+    buffer_list_len[which]++;
+    prepend_node(&buffer_lists[which], &x->node);
+}
+
+/* Demote the least recently used active buffers until the active list
+   is no bigger than BUF_ACTIVE_PERCENT of the cache. */
+static inline void
+balance_buffer_lists(void)
+{
+    while(buffer_list_len[BUF_ACTIVE] * 100 > nr_buffers * BUF_ACTIVE_PERCENT)
+	move_buffer((struct buf_head *)buffer_lists[BUF_ACTIVE].tailpred,
+		    BUF_INACTIVE);
+}
+
+/* Note that the cached buffer X has just been used again. */
+static inline void
+touch_buffer(struct buf_head *x)
+{
+    if(x->read_ahead)
+    {
+	/* This is the first real use of a read-ahead block, it doesn't
+	   count as a re-reference. */
+	x->read_ahead = FALSE;
+	buf_stats.ra_hits++;
+    }
+    else if((x->lru == BUF_INACTIVE)
+       && ((buf_stats.total_accessed - x->last_access) > BUF_CORRELATED_ACCESSES))
+    {
+	move_buffer(x, BUF_ACTIVE);
+	balance_buffer_lists();
+    }
+    else
+	move_buffer(x, x->lru);
+    x->last_access = buf_stats.total_accessed;
+}
+
+
+/* Dirty buffers. All changes to a buffer's `dirty' flag go through these
+   two functions so that nr_dirty_buffers stays accurate. */
+
+static inline void
+set_dirty(struct buf_head *x)
+{
+    if(!x->dirty)
+    {
+	x->dirty = TRUE;
+	x->dirty_time = get_timer_ticks();
+	nr_dirty_buffers++;
+    }
+}
+
+static inline void
+clear_dirty(struct buf_head *x)
+{
+    if(x->dirty)
+    {
+	x->dirty = FALSE;
+	nr_dirty_buffers--;
+    }
+}
+
+/* Returns TRUE if more than PERCENT percent of the buffers are dirty. */
+static inline bool
+dirty_over_p(u_long percent)
+{
+    return nr_dirty_buffers * 100 > nr_buffers * percent;
+}
+
+/* Returns TRUE if the cached block BLK of DEV is dirty and may be
+   written along with one of its neighbours. This should be called in
+   the middle of a LOCK_CACHE(). */
+static inline bool
+cluster_candidate_p(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *x = find_buffer(dev, blk);
+    return (x != NULL) && x->dirty && (x->use_count == 0)
+#ifndef TEST
+	&& !x->locked
+#endif
+	;
+}
+
+/* Write the dirty buffer X to its device, along with any unreferenced
+   dirty buffers holding the blocks on either side of it (up to
+   WB_MAX_BLOCKS in all). The run of blocks is copied into wb_buffer and
+   written by a single device request. The buffers stay in the cache (but
+   can't be evicted) while they're being written. This should be called
+   in the middle of a LOCK_CACHE() and MAY sleep. Returns FALSE if the
+   blocks couldn't be written, the buffers are then left dirty and
+   marked with `write_error' so that they aren't evicted. */
+static bool
+write_buffer(struct buf_head *x)
+{
+    struct buf_head *bufs[WB_MAX_BLOCKS];
+    u_long dirty_times[WB_MAX_BLOCKS];
+    struct fs_device *dev = x->dev;
+    blkno start = x->blkno;
+    u_long now = get_timer_ticks();
+    int i, n = 1;
+    bool rc = TRUE;
+    if((wb_buffer != NULL) && !wb_busy)
+    {
+	while((n < WB_MAX_BLOCKS) && (start > 0)
+	      && cluster_candidate_p(dev, start - 1))
+	{
+	    start--;
+	    n++;
+	}
+	while((n < WB_MAX_BLOCKS) && cluster_candidate_p(dev, start + n))
+	    n++;
+    }
+    for(i = 0; i < n; i++)
+    {
+	struct buf_head *y = (start + i == x->blkno
+			      ? x : find_buffer(dev, start + i));
+	u_long wait = now - y->dirty_time;
+	y->use_count++;
+	dirty_times[i] = y->dirty_time;
+	clear_dirty(y);
+	y->writing = TRUE;
+	buf_stats.write_wait_total += wait;
+	if(wait > buf_stats.write_wait_max)
+	    buf_stats.write_wait_max = wait;
+	bufs[i] = y;
+    }
+    cache_busy--;
+    if(n == 1)
+	ERRNO = FS_WRITE_BLOCKS(dev, start, x->buf->data, 1);
+    else
+    {
+	wb_busy = TRUE;
+	for(i = 0; i < n; i++)
+	    memcpy(wb_buffer + (i * FS_BLKSIZ), bufs[i]->buf->data, FS_BLKSIZ);
+	ERRNO = FS_WRITE_BLOCKS(dev, start, wb_buffer, n);
+	wb_busy = FALSE;
+    }
+    cache_busy++;
+    if((ERRNO < 0) && !handle_device_error(x, F_WRITE))
+    {
+	kprintf("buffer_cache: Can't write blocks %d-%d to device %s\n",
+		start, start + n - 1, dev->name);
+	rc = FALSE;
+    }
+    for(i = 0; i < n; i++)
+    {
+	struct buf_head *y = bufs[i];
+	if(!rc)
+	{
+	    /* The blocks aren't on the disk, so keep them dirty (as old as
+	       they were) and out of the way of choose_victim(). */
+	    set_dirty(y);
+	    y->dirty_time = dirty_times[i];
+	    y->write_error = TRUE;
+	}
+	else
+	    y->write_error = FALSE;
+	y->writing = FALSE;
+	y->use_count--;
+    }
+    buf_stats.write_requests++;
+    buf_stats.flushed_blocks += n;
+    return rc;
+}
+
+/* Write back each unreferenced buffer that has been dirty for at least
+   bdflush_age ticks. If more than bdflush_ratio percent of the cache is
+   dirty other dirty buffers are written as well, until it isn't. When
+   ALL is TRUE every dirty buffer is written regardless. This MAY sleep. */
+static void
+flush_buffers(bool all)
+{
+    struct buf_page *bp;
+#ifdef TEST
+    last_flush = get_timer_ticks();
+#endif
+    /* Changes to metadata only become dirty buffers when their
+       transaction is committed. */
+    commit_journals();
+    LOCK_CACHE();
+    buf_stats.bdflush_runs++;
+    for(bp = buf_page_list; bp != NULL; bp = bp->next)
+    {
+	int i;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
+	{
+	    struct buf_head *x = &bp->bufs[i];
+	    /* A buffer in a transaction mustn't reach its home location
+	       before the transaction's in the log. */
+	    if(!x->dirty || x->invalid || (x->transactions > 0))
+		continue;
+	    if(all || ((x->use_count == 0)
+		       && ((get_timer_ticks() - x->dirty_time >= bdflush_age)
+			   || dirty_over_p(bdflush_ratio))))
+	    {
+		write_buffer(x);
+	    }
+	}
+    }
+    UNLOCK_CACHE();
+}
+
+/* Write every dirty buffer in the cache to its device, except those
+   changed by transactions that haven't been committed yet. */
+void
+sync_buffers(void)
+{
+    flush_buffers(TRUE);
+}
+
+#ifndef TEST
+/* The bdflush task. Periodically writes back old dirty buffers. */
+static void
+bdflush(void)
+{
+    while(1)
+    {
+	kernel->sleep_for_ticks(bdflush_interval);
+	flush_buffers(FALSE);
+    }
+}
+#endif
+
+
+/* Growing and shrinking the cache. */
+
+/* Add another page of buffers to the cache, if there's enough free
+   memory. Returns TRUE if it could. This should be called in the middle
+   of a LOCK_CACHE(). */
+static bool
+grow_buffers(void)
+{
+    struct buf_page *bp;
+    int i;
+    if(free_page_count() <= BUF_FREE_RESERVE)
+	return FALSE;
+    if((bp = spare_buf_pages) != NULL)
+	spare_buf_pages = bp->next;
+    else
+    {
+	bp = malloc(sizeof(struct buf_page));
+	if(bp == NULL)
+	    return FALSE;
+    }
+    bp->data = alloc_page();
+    if(bp->data == NULL)
+    {
+	bp->next = spare_buf_pages;
+	spare_buf_pages = bp;
+	return FALSE;
+    }
+    for(i = 0; i < BUFS_PER_PAGE; i++)
+    {
+	struct buf_head *x = &bp->bufs[i];
+	x->page = bp;
+	x->dev = NULL;
+	x->hash_next = NULL;
+	x->use_count = 0;
+	x->dirty = FALSE;
+	x->invalid = TRUE;
+	x->read_ahead = FALSE;
+	x->writing = x->write_error = FALSE;
+	x->transactions = 0;
+#ifndef TEST
+	x->locked = FALSE;
+	x->locked_tasks = NULL;
+#endif
+	x->buf = (union blk_data *)&bp->data->mem[i * FS_BLKSIZ];
+	x->lru = BUF_FREE;
+	buffer_list_len[BUF_FREE]++;
+	append_node(&buffer_lists[BUF_FREE], &x->node);
+    }
+    bp->next = buf_page_list;
+    buf_page_list = bp;
+    buf_pages++;
+    nr_buffers += BUFS_PER_PAGE;
+    if(nr_buffers > buffer_hash_size * BUFFER_HASH_LOAD)
+	resize_hash(buffer_hash_size * 2);
+    return TRUE;
+}
+
+/* Returns TRUE if none of the buffers in BP are in use. */
+static inline bool
+buf_page_idle_p(struct buf_page *bp)
 {
     int i;
-    for(i = 0; i < BUFFER_BUCKETS; i++)
-	init_list(&buffer_table[i]);
-    for(i = 0; i < (NR_BUFFERS - 1); i++)
-	buffer_pool[i].link.next_free = &buffer_pool[i+1];
-    buffer_pool[i].link.next_free = NULL;
-    bh_free_list = buffer_pool;
+    for(i = 0; i < BUFS_PER_PAGE; i++)
+    {
+	struct buf_head *x = &bp->bufs[i];
+	if((x->use_count != 0) || (x->dirty && !x->invalid))
+	    return FALSE;
+#ifndef TEST
+	if(x->locked)
+	    return FALSE;
+#endif
+    }
+    return TRUE;
+}
+
+/* Called by the page allocator when it's run out of memory. Discards up
+   to COUNT pages of unused, clean buffers. May not sleep. */
+static u_long
+buffer_shrinker(u_long count)
+{
+    struct buf_page **bpp = &buf_page_list;
+    u_long freed = 0;
+    if(cache_busy)
+	return 0;
+    while((*bpp != NULL) && (freed < count)
+	  && (nr_buffers - BUFS_PER_PAGE >= NR_BUFFERS))
+    {
+	struct buf_page *bp = *bpp;
+	if(buf_page_idle_p(bp))
+	{
+	    int i;
+	    for(i = 0; i < BUFS_PER_PAGE; i++)
+	    {
+		struct buf_head *x = &bp->bufs[i];
+		if(x->dev != NULL)
+		    unhash_buffer(x);
+		clear_dirty(x);
+		remove_node(&x->node);
+		buffer_list_len[(int)x->lru]--;
+	    }
+	    *bpp = bp->next;
+	    free_page(bp->data);
+	    bp->data = NULL;
+	    bp->next = spare_buf_pages;
+	    spare_buf_pages = bp;
+	    buf_pages--;
+	    nr_buffers -= BUFS_PER_PAGE;
+	    freed++;
+	}
+	else
+	    bpp = &bp->next;
+    }
+    return freed;
 }
 
+
 void
-kill_buffers(void)
+init_buffers(void)
 {
     int i;
-    for(i = 0; i < NR_BUFFERS; i++)
+    for(i = 0; i < BUF_NR_LISTS; i++)
+    {
+	init_list(&buffer_lists[i]);
+	buffer_list_len[i] = 0;
+    }
+    buf_page_list = spare_buf_pages = NULL;
+    buf_pages = nr_buffers = 0;
+    buffer_hash = NULL;
+    buffer_hash_size = 0;
+    resize_hash(BUFFER_HASH_MIN);
+#ifndef TEST
+    for(i = 0; i < BUFFER_LOCKS; i++)
+	set_sem_clear(&bucket_locks[i]);
+#endif
+    while(nr_buffers < NR_BUFFERS)
     {
-	if(buffer_pool[i].dirty)
+	if(!grow_buffers())
 	{
-	    FS_WRITE_BLOCKS(buffer_pool[i].dev, buffer_pool[i].blkno,
-			    &buffer_pool[i].buf.data, 1);
+	    kprintf("buffer_cache: Can only allocate %d buffers\n",
+		    nr_buffers);
+	    break;
 	}
     }
+    ra_buffer = malloc(RA_MAX_BLOCKS * FS_BLKSIZ);
+    wb_buffer = malloc(WB_MAX_BLOCKS * FS_BLKSIZ);
+    nr_dirty_buffers = 0;
+#ifndef TEST
+    kernel->add_page_shrinker(&shrinker);
+    bdflush_task = kernel->add_task(bdflush, TASK_RUNNING, 0, "bdflush");
+#else
+    last_flush = get_timer_ticks();
+#endif
+}
+
+void
+kill_buffers(void)
+{
+#ifndef TEST
+    if(bdflush_task != NULL)
+    {
+	kernel->kill_task(bdflush_task);
+	bdflush_task = NULL;
+    }
+    kernel->remove_page_shrinker(&shrinker);
+#endif
+    sync_buffers();
 }
 
-/* This should be called in the middle of a forbid(). */
+/* Returns the least recently used buffer in the list WHICH that can be
+   evicted, or NULL. If DATA-ONLY is TRUE only data buffers may be
+   chosen. */
 static inline struct buf_head *
-find_buffer(struct fs_device *dev, blkno blk)
+find_victim(int which, bool data_only)
 {
-    struct buf_head *nxt, *x;
-    x = (struct buf_head *)buffer_table[BUFFER_HASH(blk)].head;
-    while((nxt = (struct buf_head *)x->link.node.succ) != NULL)
+    struct buf_head *nxt, *x = (struct buf_head *)buffer_lists[which].tailpred;
+    while((nxt = (struct buf_head *)x->node.pred) != NULL)
     {
-	if((x->blkno == blk) && (x->dev == dev) && !x->invalid)
+	if(x->use_count == 0
+	   && (!data_only || (x->type == BUF_CLASS_DATA))
+	   && (!x->write_error || x->invalid)
+#ifndef TEST
+	   && !x->locked
+#endif
+	   )
 	    return x;
 	x = nxt;
     }
     return NULL;
 }
 
-/* Try to move an unreferenced but cached buffer from the hash queues
-   to the free list of buffers. Returns TRUE if there *may* be a buffer
-   available (no guarantee), FALSE if there definitely isn't.
-   This function MAY sleep. */
+/* Choose the buffer to evict, preferring the inactive list, and data to
+   metadata while metadata hasn't outgrown its share of the cache. */
+static inline struct buf_head *
+choose_victim(void)
+{
+    struct buf_head *x = NULL;
+    u_long meta = nr_buffers - buffer_list_len[BUF_FREE]
+		  - buffer_class_len[BUF_CLASS_DATA];
+    if(meta * 100 <= nr_buffers * BUF_META_PERCENT)
+    {
+	x = find_victim(BUF_INACTIVE, TRUE);
+	if(x == NULL)
+	    x = find_victim(BUF_ACTIVE, TRUE);
+    }
+    if(x == NULL)
+	x = find_victim(BUF_INACTIVE, FALSE);
+    if(x == NULL)
+	x = find_victim(BUF_ACTIVE, FALSE);
+    return x;
+}
+
+/* Try to move an unreferenced but cached buffer from the inactive (or
+   failing that, the active) list to the free list of buffers. Returns
+   TRUE if there *may* be a buffer available (no guarantee), FALSE if
+   there definitely isn't. This function MAY sleep. */
 static bool
 make_free_buffer(void)
 {
-    /* Try to flush an unused buffer, otherwise we have to fail :-( */
     struct buf_head *x;
-    int tries = 0;
-    FORBID();
-    while(tries++ < BUFFER_BUCKETS)
+    u_long age;
+    LOCK_CACHE();
+    x = choose_victim();
+    if(x == NULL)
     {
-	static int last_bucket;
-	struct buf_head *nxt;
-	last_bucket = (last_bucket + 1) % BUFFER_BUCKETS;
-	x = (struct buf_head *)buffer_table[last_bucket].tailpred;
-	while((nxt = (struct buf_head *)x->link.node.pred) != NULL)
+	/* Everything's in use, we have to fail :-( */
+	UNLOCK_CACHE();
+	ERRNO = E_NOMEM;
+	return FALSE;
+    }
+    if(x->dirty && !x->invalid)
+    {
+	/* Write it back first; it stays in the cache (but can't be
+	   evicted by anyone else) until the write's finished. */
+	write_buffer(x);
+	buf_stats.dirty_accesses++;
+	if((x->use_count != 0) || x->dirty)
 	{
-	    if(x->use_count == 0)
-	    {
-		remove_node(&x->link.node);
-		if(x->dirty)
-		{
-		    ERRNO = FS_WRITE_BLOCKS(x->dev, x->blkno, &x->buf, 1);
-		    if((ERRNO < 0) || !handle_device_error(x, F_WRITE))
-		    {
-			kprintf("buffer_cache: Can't write block %d to device %s\n",
-				x->blkno, x->dev->name);
-		    }
-		    dirty_accesses++;
-		}
-		x->link.next_free = bh_free_list;
-		bh_free_list = x;
-		PERMIT();
-		return TRUE;
-	    }
-	    x = nxt;
+	    /* Someone started using it while we slept. */
+	    UNLOCK_CACHE();
+	    return TRUE;
 	}
     }
-    PERMIT();
-    ERRNO = E_NOMEM;
-    return FALSE;
+    age = buf_stats.total_accessed - x->last_access;
+    if((buf_stats.evictions == 0) || (age < buf_stats.evict_age_min))
+	buf_stats.evict_age_min = age;
+    buf_stats.evict_age_total += age;
+    buf_stats.evictions++;
+    x->dev->stats.evictions++;
+    if(x->lru == BUF_ACTIVE)
+	buf_stats.active_evictions++;
+    if(x->read_ahead)
+	buf_stats.ra_wasted++;
+    clear_dirty(x);
+    unhash_buffer(x);
+    move_buffer(x, BUF_FREE);
+    x->dev = NULL;
+    UNLOCK_CACHE();
+    return TRUE;
+}
+
+/* Return an unused buffer, taking it from the free list, growing the
+   cache or evicting the least recently used buffer. Returns NULL if
+   every buffer is in use. This should be called in the middle of a
+   LOCK_CACHE(), and MAY sleep. */
+static struct buf_head *
+get_free_buffer(void)
+{
+    while(list_empty_p(&buffer_lists[BUF_FREE]))
+    {
+	if(!grow_buffers() && !make_free_buffer())
+	    return NULL;
+    }
+    return (struct buf_head *)buffer_lists[BUF_FREE].head;
+}
+
+/* Put the free buffer X in the cache as block BLK of DEV, a block of
+   class CLASS. This should be called in the middle of a LOCK_CACHE(). */
+static inline void
+install_buffer(struct buf_head *x, struct fs_device *dev, blkno blk,
+	       int class)
+{
+    x->dev = dev;
+    x->blkno = blk;
+    x->type = class;
+    buffer_class_len[class]++;
+    x->last_access = buf_stats.total_accessed;
+    x->use_count = 1;
+    clear_dirty(x);
+    x->invalid = FALSE;
+    x->read_ahead = FALSE;
+    x->write_error = x->writing = FALSE;
+    hash_buffer(x);
+    move_buffer(x, BUF_INACTIVE);
+}
+
+/* Take the cached buffer X out of the cache and put it on the free
+   list. This should be called in the middle of a LOCK_CACHE(). */
+static inline void
+discard_buffer(struct buf_head *x)
+{
+    unhash_buffer(x);
+    move_buffer(x, BUF_FREE);
+    x->dev = NULL;
+    x->use_count = 0;
+    clear_dirty(x);
+}
+
+/* Look for a cached copy of the block BLK of device DEV, waiting for any
+   read of it that's in progress to finish. If there is one its use count
+   is incremented, it's marked as being of class CLASS and it's returned,
+   otherwise NULL. This should be called in the middle of a LOCK_CACHE(),
+   and MAY sleep. */
+static struct buf_head *
+lookup_buffer(struct fs_device *dev, blkno blk, int class)
+{
+    struct buf_head *x;
+    while((x = find_buffer(dev, blk)) != NULL)
+    {
+#ifndef TEST
+	if(x->locked)
+	{
+	    /* Another task is reading this block. Sleep until it's
+	       finished. */
+	    u_long start = get_timer_ticks();
+	    buf_stats.buffer_lock_waits++;
+	    cache_busy--;
+	    kernel->sleep_in_task_list(&x->locked_tasks);
+	    cache_busy++;
+	    note_lock_wait(start);
+	    continue;
+	}
+#endif
+	x->use_count++;
+	touch_buffer(x);
+	if(x->type != class)
+	{
+	    /* The block has been reused for something else. */
+	    buffer_class_len[(int)x->type]--;
+	    x->type = class;
+	    buffer_class_len[class]++;
+	}
+	buf_stats.class_hits[class]++;
+	x->dev->stats.hits++;
+	buf_stats.cached_accesses++;
+	break;
+    }
+    return x;
 }
 
 /* Return a buffer containing the block BLKNO of the device DEV, or NULL if
-   an error occurred or there's no free buffers. This function MAY sleep. */
+   an error occurred or there's no free buffers. CLASS is the kind of
+   block being read, BUF_CLASS_DATA or one of the metadata classes. This
+   function MAY sleep. */
 struct buf_head *
-bread(struct fs_device *dev, blkno blk)
+bread_class(struct fs_device *dev, blkno blk, int class)
 {
     struct buf_head *x;
+    u_long locked_at, started;
     DB(("bread(`%s', %d)\n", dev->name, blk));
     if(!test_media(dev))
 	return NULL;
-    total_accessed++;
-    FORBID();
-again:
-    x = find_buffer(dev, blk);
+    buf_stats.total_accessed++;
+    LOCK_CACHE();
+    x = lookup_buffer(dev, blk, class);
     if(x != NULL)
     {
+	UNLOCK_CACHE();
+	return x;
+    }
+    /* Couldn't find a cached copy of the buffer. Lock its bucket so that
+       no one else can add it while we're finding a free buffer, then
+       look again in case someone did while we were waiting. */
+    cache_busy--;
+    locked_at = lock_bucket(dev, blk);
+    cache_busy++;
+    x = lookup_buffer(dev, blk, class);
+    if((x != NULL) || ((x = get_free_buffer()) == NULL))
+    {
+	unlock_bucket(dev, blk, locked_at);
+	UNLOCK_CACHE();
+	return x;
+    }
+    install_buffer(x, dev, blk, class);
+    buf_stats.class_misses[class]++;
+    dev->stats.misses++;
 #ifndef TEST
-	if(x->locked)
-	{
-	    /* Another task is waiting on this buffer. Sleep until it
-	       wakes. */
-	    kernel->sleep_in_task_list(&x->locked_tasks);
-	    goto again;
-	}
+    /* This signals that any other tasks wanting this block should wait
+       until we've finished reading the block. Effectively the tasks
+       are synchronised. */
+    x->locked = TRUE;
 #endif
-	x->use_count++;
-	/* Move x to the head of the list to show it was recently used. */
-	remove_node(&x->link.node);
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
-	cached_accesses++;
+    unlock_bucket(dev, blk, locked_at);
+    cache_busy--;
+    started = get_timer_ticks();
+    ERRNO = FS_READ_BLOCKS(dev, blk, x->buf->data, 1);
+    note_read_latency(started);
+    cache_busy++;
+    if((ERRNO < 0) && !handle_device_error(x, F_READ))
+    {
+	discard_buffer(x);
+#ifndef TEST
+	x->locked = FALSE;
+	kernel->wake_up_task_list(&x->locked_tasks);
+#endif
+	x = NULL;
     }
     else
     {
-	/* Couldn't find a cached copy of the buffer. Make a new one. */
-	if((x = bh_free_list) == NULL)
+#ifndef TEST
+	x->locked = FALSE;
+	kernel->wake_up_task_list(&x->locked_tasks);
+#endif
+    }
+    UNLOCK_CACHE();
+    return x;
+}
+
+/* Return a buffer containing the data block BLKNO of the device DEV, see
+   bread_class(). */
+struct buf_head *
+bread(struct fs_device *dev, blkno blk)
+{
+    return bread_class(dev, blk, BUF_CLASS_DATA);
+}
+
+/* Read up to COUNT consecutive blocks, starting with block BLK of the
+   device DEV, into the cache using a single device request. Blocks at the
+   start of the range which are already cached are skipped and the
+   request stops at the next cached block, or the next block whose bucket
+   is locked by another task. Nothing is returned, this is only a hint
+   that the blocks will soon be wanted by bread().
+   This function MAY sleep. */
+void
+bread_ahead(struct fs_device *dev, blkno blk, int count)
+{
+    struct buf_head *bufs[RA_MAX_BLOCKS];
+    int i, n, saved_errno = ERRNO;
+    if((ra_buffer == NULL) || ra_busy || !test_media(dev))
+	return;
+    if(count > RA_MAX_BLOCKS)
+	count = RA_MAX_BLOCKS;
+    LOCK_CACHE();
+    while((count > 0) && (find_buffer(dev, blk) != NULL))
+    {
+	blk++;
+	count--;
+    }
+    for(n = 0; n < count; n++)
+    {
+	struct buf_head *x;
+	u_long locked_at;
+	if(bucket_locked_p(dev, blk + n))
+	    break;
+	locked_at = lock_bucket(dev, blk + n);
+	/* get_free_buffer() may sleep. */
+	if((find_buffer(dev, blk + n) != NULL)
+	   || ((x = get_free_buffer()) == NULL))
 	{
-	    if(make_free_buffer())
-		goto again;
-	    else
-	    {
-		PERMIT();
-		return NULL;
-	    }
+	    unlock_bucket(dev, blk + n, locked_at);
+	    break;
 	}
-	bh_free_list = x->link.next_free;
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
-	x->dev = dev;
-	x->blkno = blk;
-	x->use_count = 1;
-	x->dirty = FALSE;
-	x->invalid = FALSE;
+	install_buffer(x, dev, blk + n, BUF_CLASS_DATA);
+	x->read_ahead = TRUE;
 #ifndef TEST
-	/* This signals that any other tasks wanting this block should wait
-	   until we've finished reading the block. Effectively the tasks
-	   are synchronised. */
 	x->locked = TRUE;
 #endif
-	ERRNO = FS_READ_BLOCKS(dev, blk, &x->buf, 1);
-	if((ERRNO < 0) && !handle_device_error(x, F_READ))
+	unlock_bucket(dev, blk + n, locked_at);
+	bufs[n] = x;
+    }
+    if(n > 0)
+    {
+	u_long started = get_timer_ticks();
+	ra_busy = TRUE;
+	cache_busy--;
+	ERRNO = FS_READ_BLOCKS(dev, blk, ra_buffer, n);
+	note_read_latency(started);
+	cache_busy++;
+	ra_busy = FALSE;
+	buf_stats.ra_requests++;
+	for(i = 0; i < n; i++)
 	{
-	    remove_node(&x->link.node);
+	    struct buf_head *x = bufs[i];
+	    if(ERRNO >= 0)
+	    {
+		memcpy(x->buf->data, ra_buffer + (i * FS_BLKSIZ), FS_BLKSIZ);
+		x->use_count--;
+		buf_stats.ra_blocks++;
+	    }
+	    else
+		discard_buffer(x);
 #ifndef TEST
+	    x->locked = FALSE;
 	    kernel->wake_up_task_list(&x->locked_tasks);
 #endif
-	    x->link.next_free = bh_free_list;
-	    bh_free_list = x;
-	    x = NULL;
 	}
-	else
+    }
+    UNLOCK_CACHE();
+    ERRNO = saved_errno;
+}
+
+/* Find or make a buffer for block BLK of device DEV which is about to be
+   completely overwritten, so its contents needn't be read. If a buffer
+   is returned the cache is still locked, otherwise it's unlocked. */
+static struct buf_head *
+overwrite_buffer(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *x;
+    if(!test_media(dev))
+	return NULL;
+    buf_stats.total_accessed++;
+    LOCK_CACHE();
+    x = lookup_buffer(dev, blk, BUF_CLASS_DATA);
+    if(x == NULL)
+    {
+	/* No cached version of this buffer. See bread(). */
+	u_long locked_at;
+	cache_busy--;
+	locked_at = lock_bucket(dev, blk);
+	cache_busy++;
+	x = lookup_buffer(dev, blk, BUF_CLASS_DATA);
+	if((x == NULL) && ((x = get_free_buffer()) != NULL))
 	{
-#ifndef TEST
-	    x->locked = FALSE;
-	    kernel->wake_up_task_list(&x->locked_tasks);
-#endif
+	    install_buffer(x, dev, blk, BUF_CLASS_DATA);
+	    buf_stats.class_misses[BUF_CLASS_DATA]++;
+	    dev->stats.misses++;
 	}
+	unlock_bucket(dev, blk, locked_at);
+	if(x == NULL)
+	    UNLOCK_CACHE();
     }
-    PERMIT();
     return x;
 }
 
@@ -193,78 +1074,133 @@ bwrite(struct fs_device *dev, blkno blk, const void *data)
 {
     struct buf_head *x;
     DB(("bwrite(`%s', %d)\n", dev->name, blk));
-    if(!test_media(dev))
+    x = overwrite_buffer(dev, blk);
+    if(x == NULL)
 	return FALSE;
-    total_accessed++;
-    FORBID();
-again:
-    x = find_buffer(dev, blk);
-    if(x != NULL)
+    memcpy(x->buf->data, data, FS_BLKSIZ);
+    set_dirty(x);
+    UNLOCK_CACHE();
+    brelse(x);
+    return TRUE;
+}
+
+/* Like bwrite() except that the FS_BLKSIZ bytes written are gathered from
+   the COUNT segments IOV, starting OFFSET bytes into the first segment.
+   The segments must hold at least that much data. */
+bool
+bwrite_vec(struct fs_device *dev, blkno blk, const struct fs_iovec *iov,
+	   int count, size_t offset)
+{
+    struct buf_head *x;
+    size_t done = 0;
+    DB(("bwrite_vec(`%s', %d)\n", dev->name, blk));
+    x = overwrite_buffer(dev, blk);
+    if(x == NULL)
+	return FALSE;
+    while((done < FS_BLKSIZ) && (count > 0))
     {
-#ifndef TEST
-	if(x->locked)
-	{
-	    /* Another task is waiting on this buffer. Sleep until it
-	       wakes. */
-	    kernel->sleep_in_task_list(&x->locked_tasks);
-	    goto again;
-	}
-#endif
-	x->use_count++;
-	/* Move x to the head of the list to show it was recently used. */
-	remove_node(&x->link.node);
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
-	cached_accesses++;
+	size_t this = min(iov->len - offset, FS_BLKSIZ - done);
+	memcpy(x->buf->data + done, (const u_char *)iov->base + offset, this);
+	done += this;
+	iov++;
+	count--;
+	offset = 0;
     }
-    else
+    set_dirty(x);
+    UNLOCK_CACHE();
+    brelse(x);
+    return TRUE;
+}
+
+/* Write back any dirty cached copies of the COUNT blocks starting at
+   block BLK of device DEV. This is called before the blocks are read
+   without going through the cache. This function MAY sleep. */
+void
+bflush_blocks(struct fs_device *dev, blkno blk, int count)
+{
+    LOCK_CACHE();
+    while(count-- > 0)
+    {
+	struct buf_head *x = find_buffer(dev, blk++);
+	if((x != NULL) && x->dirty)
+	    write_buffer(x);
+    }
+    UNLOCK_CACHE();
+}
+
+/* Update any cached copies of the COUNT blocks starting at block BLK of
+   device DEV from the COUNT * FS_BLKSIZ bytes at DATA. This is called
+   before DATA is written to the blocks without going through the cache,
+   so the copies are marked clean. Copies still being read from the device
+   are invalidated instead. */
+void
+bupdate_blocks(struct fs_device *dev, blkno blk, int count, const void *data)
+{
+    LOCK_CACHE();
+    while(count-- > 0)
     {
-	/* No cached version of this buffer. */
-	if((x = bh_free_list) == NULL)
+	struct buf_head *x = find_buffer(dev, blk++);
+	if(x != NULL)
 	{
-	    if(make_free_buffer())
-		goto again;
+#ifndef TEST
+	    if(x->locked)
+		x->invalid = TRUE;
 	    else
+#endif
 	    {
-		PERMIT();
-		return FALSE;
+		memcpy(x->buf->data, data, FS_BLKSIZ);
+		clear_dirty(x);
 	    }
 	}
-	bh_free_list = x->link.next_free;
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
-	x->dev = dev;
-	x->blkno = blk;
-	x->use_count = 1;
-	x->invalid = FALSE;
-#ifndef TEST
-	x->locked = FALSE;
-#endif
+	data += FS_BLKSIZ;
     }
-    memcpy(&x->buf, data, FS_BLKSIZ);
-    x->dirty = TRUE;
-    PERMIT();
-    brelse(x);
-    return TRUE;
+    UNLOCK_CACHE();
+}
+
+/* Mark any cached copies of the COUNT blocks starting at block BLK of
+   device DEV as dirty. This is called when writing the blocks without
+   going through the cache failed after bupdate_blocks() made the copies
+   clean, so that bdflush writes them instead. */
+void
+bdirty_blocks(struct fs_device *dev, blkno blk, int count)
+{
+    LOCK_CACHE();
+    while(count-- > 0)
+    {
+	struct buf_head *x = find_buffer(dev, blk++);
+	if((x != NULL) && !x->invalid)
+	    set_dirty(x);
+    }
+    UNLOCK_CACHE();
 }
 
 /* Mark that the contents of the buffer BH has been modified since it
-   was returned from bread(). If WRITE-NOW is TRUE the contents of the
-   block will be written to its device immediately. */
+   was returned from bread(). Dirty buffers are written back by the
+   bdflush task; if WRITE-NOW is TRUE the block will be written by its
+   next pass instead of waiting until it's bdflush_age ticks old. */
 void
 bdirty(struct buf_head *bh, bool write_now)
 {
     test_media(bh->dev);
     if(bh->invalid)
 	return;
-    bh->dirty = TRUE;
-    if(write_now)
-    {
-	/* Have to clear this hear in case any other tasks come along and
-	   dirty the buffer while we're writing it. */
-	bh->dirty = FALSE;
-	ERRNO = FS_WRITE_BLOCKS(bh->dev, bh->blkno, &bh->buf.data, 1);
-	if((ERRNO < 0) && !handle_device_error(bh, F_WRITE))
-	    bh->dirty = TRUE;
-    }
+    set_dirty(bh);
+    if(write_now && (get_timer_ticks() - bh->dirty_time < bdflush_age))
+	bh->dirty_time = get_timer_ticks() - bdflush_age;
+}
+
+/* Returns TRUE if block BLK of device DEV is cached and has been changed
+   since it was last written, or is being written now. */
+bool
+bdirty_p(struct fs_device *dev, blkno blk)
+{
+    struct buf_head *x;
+    bool rc;
+    LOCK_CACHE();
+    x = find_buffer(dev, blk);
+    rc = (x != NULL) && (x->dirty || x->writing) && !x->invalid;
+    UNLOCK_CACHE();
+    return rc;
 }
 
 /* Release your hold on the buffer BH. */
@@ -277,46 +1213,54 @@ brelse(struct buf_head *bh)
     {
 	if(bh->invalid)
 	{
-	    FORBID();
-	    remove_node(&bh->link.node);
-	    bh->link.next_free = bh_free_list;
-	    bh_free_list = bh;
-	    PERMIT();
+	    LOCK_CACHE();
+	    discard_buffer(bh);
+	    UNLOCK_CACHE();
 	    return;
 	}
+	if(bh->dirty && dirty_over_p(bdflush_limit))
+	{
+	    /* Too much of the cache is dirty for bdflush to keep up,
+	       make the task that dirtied this buffer write it. */
+	    LOCK_CACHE();
+	    buf_stats.throttled_writes++;
+	    write_buffer(bh);
+	    UNLOCK_CACHE();
+	}
     }
-#ifndef LAZY_WRITES
-    if(bh->dirty)
-    {
-	/* see bdirty() */
-	bh->dirty = FALSE;
-	ERRNO = FS_WRITE_BLOCKS(bh->dev, bh->blkno, &bh->buf.data, 1);
-	if((ERRNO < 0) && !handle_device_error(bh, F_WRITE))
-	    bh->dirty = TRUE;
-    }
-#endif
     bh->use_count--;
+#ifdef TEST
+    if(get_timer_ticks() - last_flush >= bdflush_interval)
+	flush_buffers(FALSE);
+#endif
 }
 
 /* Flush all cached blocks from the device DEV. If DONT-WRITE is TRUE
    then this function isn't allowed to write to the device (presumably
    because the media was changed), note that this may lead to cached
-   writes going missing... */
+   writes going missing... Otherwise the device's open transaction is
+   committed first, buffers still held by a transaction aren't written
+   in place. */
 void
 flush_device_cache(struct fs_device *dev, bool dont_write)
 {
-    int i;
+    struct buf_page *bp;
+    if(!dont_write)
+	commit_journal(dev);
     FORBID();
-    for(i = 0; i < NR_BUFFERS; i++)
+    for(bp = buf_page_list; bp != NULL; bp = bp->next)
     {
-	if(buffer_pool[i].dev == dev)
+	int i;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
 	{
-	    buffer_pool[i].invalid = TRUE;
-	    if(buffer_pool[i].dirty && !dont_write)
+	    struct buf_head *x = &bp->bufs[i];
+	    if(x->dev == dev)
 	    {
-		buffer_pool[i].dirty = FALSE;
-		FS_WRITE_BLOCKS(buffer_pool[i].dev, buffer_pool[i].blkno,
-			       &buffer_pool[i].buf.data, 1);
+		if(x->dirty && !x->invalid && !dont_write
+		   && (x->transactions == 0))
+		    FS_WRITE_BLOCKS(x->dev, x->blkno, x->buf->data, 1);
+		clear_dirty(x);
+		x->invalid = TRUE;
 	    }
 	}
     }
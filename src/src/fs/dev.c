@@ -72,6 +72,9 @@ add_device(struct fs_device *dev)
     dev->root = NULL;
     dev->use_count = 1;
     dev->invalid = TRUE;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->data_bmap.block_free = dev->inode_bmap.block_free = NULL;
+    dev->journal = NULL;
     FORBID();
     dev->next = device_list;
     device_list = dev;
@@ -108,7 +111,13 @@ release_device(struct fs_device *dev)
 {
     if(--dev->use_count <= 0)
     {
-	/* Last one out turn off the light.. */
+	/* Last one out turn off the light.. Any buffers still waiting
+	   for bdflush have to be written first. */
+	if(!dev->invalid)
+	{
+	    close_journal(dev);
+	    flush_device_cache(dev, FALSE);
+	}
 	invalidate_device(dev);
 	kprintf("fs: Device `%s' has been discarded.\n", dev->name);
 	free_device(dev);
@@ -160,7 +169,21 @@ read_meta_data(struct fs_device *dev)
 	ERRNO = E_BADMAGIC;
 	return FALSE;
     }
+    if(((tmp_bb.ext.magic == FS_EXT_MAGIC)
+	? tmp_bb.ext.block_size : 1024) != FS_BLKSIZ)
+    {
+	kprintf("fs: Device `%s' doesn't use %d-byte blocks\n", dev->name,
+		FS_BLKSIZ);
+	ERRNO = E_BADMAGIC;
+	return FALSE;
+    }
     memcpy(&dev->sup, &tmp_bb.sup, sizeof(struct super_data));
+    dev->features = ((tmp_bb.ext.magic == FS_EXT_MAGIC)
+		     ? tmp_bb.ext.features : 0);
+    dev->refcount_start = tmp_bb.ext.refcount_start;
+    if(!open_journal(dev, &tmp_bb))
+	return FALSE;
+    init_bmap_info(dev);
     dev->read_only = FALSE;	/* Fix this. */
     return TRUE;
 }
@@ -179,7 +202,10 @@ invalidate_device(struct fs_device *dev)
 	dev->root = NULL;
 	dev->invalid = TRUE;
 	flush_device_cache(dev, TRUE);
+	free_journal(dev);
 	invalidate_device_inodes(dev);
+	purge_dcache(dev);
+	free_bmap_info(dev);
     }
 }
 
@@ -195,5 +221,9 @@ validate_device(struct fs_device *dev)
     dev->root = make_inode(dev, ROOT_INUM);
     if(dev->root == NULL)
 	return FALSE;
+    /* Count the free blocks and inodes now, the allocator keeps the
+       totals up to date after this. */
+    bmap_count_free(dev, &dev->data_bmap);
+    bmap_count_free(dev, &dev->inode_bmap);
     return TRUE;
 }
@@ -10,6 +10,8 @@
 #ifndef TEST
 # define kprintf kernel->printf
 # define current_time kernel->current_time
+# define malloc kernel->malloc
+# define free kernel->free
 #else
 struct file *current_dir;
 #endif
@@ -22,6 +24,337 @@ static struct dir_entry_blk tmp_dir_blk;
    us smashing the stack). */
 #define MAX_SYMLINK_DEPTH 8
 
+/* Directory indexes.
+
+   Large directories get an in-core hash table of their entries, hung
+   off the directory's core_inode. Each node records the hash of an
+   entry's name and its slot number in the directory file, so a lookup
+   only has to read the entries whose names hash to the same value.
+   Free slots are kept on a separate list so that creating an entry
+   doesn't need to scan the directory either. Nothing is stored on disk,
+   the index is rebuilt from the directory the first time it's searched
+   after its inode is read. */
+
+struct dir_index_ent {
+    struct dir_index_ent *next;
+    u_long hash;
+    u_long slot;		/* entry number in the directory file */
+};
+
+struct dir_index {
+    u_long dir_size;		/* size of the directory when indexed */
+    u_long nr_slots;
+    struct dir_index_ent *free_slots;
+    struct dir_index_ent *chains[DIR_INDEX_BUCKETS];
+};
+
+static inline u_long
+dir_hash(const char *name)
+{
+    u_long hash = 0;
+    while(*name)
+	hash = (hash * 31) + *name++;
+    return hash;
+}
+
+static void
+free_index_chain(struct dir_index_ent *x)
+{
+    while(x != NULL)
+    {
+	struct dir_index_ent *nxt = x->next;
+	free(x);
+	x = nxt;
+    }
+}
+
+static void
+discard_index(struct dir_index *index)
+{
+    int i;
+    for(i = 0; i < DIR_INDEX_BUCKETS; i++)
+	free_index_chain(index->chains[i]);
+    free_index_chain(index->free_slots);
+    free(index);
+}
+
+/* Discard the directory index attached to INODE. */
+void
+free_dir_index(struct core_inode *inode)
+{
+    struct dir_index *index = inode->dir_index;
+    if(index != NULL)
+    {
+	inode->dir_index = NULL;
+	discard_index(index);
+    }
+}
+
+/* Read every entry of the directory DIR and return an index of them, or
+   NULL if this isn't possible. */
+static struct dir_index *
+build_dir_index(struct file *dir)
+{
+    long tmp;
+    size_t dir_len = dir->inode->inode.size;
+    struct dir_index *index = malloc(sizeof(struct dir_index));
+    if(index == NULL)
+	return NULL;
+    memset(index, 0, sizeof(struct dir_index));
+    index->dir_size = dir_len;
+    seek_file(dir, 0, SEEK_ABS);
+    while(dir_len > 0)
+    {
+	int i;
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
+	if(tmp <= 0)
+	    goto error;
+	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
+	{
+	    struct dir_index_ent *x = malloc(sizeof(struct dir_index_ent));
+	    if(x == NULL)
+		goto error;
+	    x->slot = index->nr_slots++;
+	    if(tmp_dir_blk.entries[i].name[0] != 0)
+	    {
+		x->hash = dir_hash(tmp_dir_blk.entries[i].name);
+		x->next = index->chains[x->hash & (DIR_INDEX_BUCKETS - 1)];
+		index->chains[x->hash & (DIR_INDEX_BUCKETS - 1)] = x;
+	    }
+	    else
+	    {
+		x->next = index->free_slots;
+		index->free_slots = x;
+	    }
+	}
+	dir_len -= tmp;
+    }
+    return index;
+error:
+    discard_index(index);
+    return NULL;
+}
+
+/* Return the index of the directory DIR, building it if necessary. NULL
+   means that DIR is too small to be worth indexing (or the index
+   couldn't be made), so it should be searched the slow way. */
+static struct dir_index *
+get_dir_index(struct file *dir)
+{
+    struct core_inode *inode = dir->inode;
+    struct dir_index *index = inode->dir_index;
+    if((index != NULL) && (index->dir_size != inode->inode.size))
+    {
+	/* The directory was changed behind our back. */
+	free_dir_index(inode);
+	index = NULL;
+    }
+    if((index == NULL)
+       && (inode->inode.size >= (DIR_INDEX_MIN * sizeof(struct dir_entry))))
+    {
+	index = build_dir_index(dir);
+	if(inode->dir_index != NULL)
+	{
+	    /* Someone else built one while we were reading. */
+	    if(index != NULL)
+		discard_index(index);
+	    index = inode->dir_index;
+	}
+	else
+	    inode->dir_index = index;
+    }
+    return index;
+}
+
+/* Search the index of DIR for an entry called NAME whose hash is HASH.
+   Returns a pointer to the link to its index node, or NULL if no such
+   entry exists. If found the entry's i-number is stored in *INUMP. */
+static struct dir_index_ent **
+index_lookup(struct core_inode *dir, const char *name, u_long hash,
+	     u_long *inump)
+{
+    struct dir_index_ent **x = &dir->dir_index->chains[hash & (DIR_INDEX_BUCKETS - 1)];
+    while(*x != NULL)
+    {
+	if((*x)->hash == hash)
+	{
+	    u_long offset = (*x)->slot * sizeof(struct dir_entry);
+	    struct buf_head *bh = get_data_block(dir, offset / FS_BLKSIZ, FALSE);
+	    if(bh != NULL)
+	    {
+		struct dir_entry *de;
+		de = (struct dir_entry *)(bh->buf->data + (offset % FS_BLKSIZ));
+		if(!strcmp(name, de->name))
+		{
+		    *inump = de->inum;
+		    brelse(bh);
+		    return x;
+		}
+		brelse(bh);
+	    }
+	}
+	x = &(*x)->next;
+    }
+    return NULL;
+}
+
+/* Name lookup cache.
+
+   Remembers the result of recent find_file_entry() calls as (device,
+   directory i-number, name) -> i-number mappings, so that opening the
+   same path again doesn't have to search each directory along it.
+   Failed lookups are cached too (with an i-number of -1), programs often
+   probe for files that don't exist. Entries are changed whenever a
+   directory entry is created or deleted, and all of a device's entries
+   go when it's invalidated. A lookup may sleep while it searches, so
+   its result is only cached if no directory has changed meanwhile
+   (dcache_changes counts the changes); otherwise it could replace the
+   entry of a file created during the search. */
+
+struct dcache_ent {
+    list_node_t node;		/* in dcache_lru, most recent first */
+    struct dcache_ent *hash_next;
+    struct fs_device *dev;	/* NULL if unused */
+    u_long dir_inum;
+    long inum;			/* -1 for a negative entry */
+    u_long hash;
+    char name[NAME_MAX + 1];
+};
+
+static struct dcache_ent dcache_pool[DCACHE_SIZE];
+static struct dcache_ent *dcache_hash_table[DCACHE_BUCKETS];
+static list_t dcache_lru;
+static u_long dcache_changes;
+
+#define DCACHE_HASH(dev, dir_inum, hash) \
+    (((((u_long)(dev)) >> 4) ^ (dir_inum) ^ (hash)) & (DCACHE_BUCKETS - 1))
+
+void
+init_dcache(void)
+{
+    int i;
+    init_list(&dcache_lru);
+    for(i = 0; i < DCACHE_SIZE; i++)
+	append_node(&dcache_lru, &dcache_pool[i].node);
+}
+
+static void
+dcache_unhash(struct dcache_ent *x)
+{
+    struct dcache_ent **ptr = &dcache_hash_table[DCACHE_HASH(x->dev,
+							    x->dir_inum,
+							    x->hash)];
+    while(*ptr != x)
+	ptr = &(*ptr)->hash_next;
+    *ptr = x->hash_next;
+    x->dev = NULL;
+}
+
+/* Find the cache entry for NAME in the directory DIR-INUM of DEV, or
+   NULL. */
+static struct dcache_ent *
+dcache_find(struct fs_device *dev, u_long dir_inum, const char *name,
+	    u_long hash)
+{
+    struct dcache_ent *x = dcache_hash_table[DCACHE_HASH(dev, dir_inum, hash)];
+    while(x != NULL)
+    {
+	if((x->hash == hash) && (x->dir_inum == dir_inum) && (x->dev == dev)
+	   && !strcmp(x->name, name))
+	{
+	    remove_node(&x->node);
+	    prepend_node(&dcache_lru, &x->node);
+	    return x;
+	}
+	x = x->hash_next;
+    }
+    return NULL;
+}
+
+/* Set the cache entry for NAME in the directory DIR-INUM of DEV to
+   INUM. */
+static void
+dcache_set(struct fs_device *dev, u_long dir_inum, const char *name,
+	   long inum)
+{
+    struct dcache_ent *x;
+    u_long hash;
+    if(strlen(name) > NAME_MAX)
+	return;
+    hash = dir_hash(name);
+    FORBID();
+    x = dcache_find(dev, dir_inum, name, hash);
+    if(x == NULL)
+    {
+	x = (struct dcache_ent *)dcache_lru.tailpred;
+	if(x->dev != NULL)
+	    dcache_unhash(x);
+	remove_node(&x->node);
+	prepend_node(&dcache_lru, &x->node);
+	x->dev = dev;
+	x->dir_inum = dir_inum;
+	x->hash = hash;
+	strcpy(x->name, name);
+	x->hash_next = dcache_hash_table[DCACHE_HASH(dev, dir_inum, hash)];
+	dcache_hash_table[DCACHE_HASH(dev, dir_inum, hash)] = x;
+    }
+    x->inum = inum;
+    PERMIT();
+}
+
+/* Record that NAME in the directory DIR has been changed to link to INUM
+   (or been deleted if INUM is -1). */
+static void
+dcache_enter(struct fs_device *dev, u_long dir_inum, const char *name,
+	     long inum)
+{
+    FORBID();
+    dcache_changes++;
+    dcache_set(dev, dir_inum, name, inum);
+    PERMIT();
+}
+
+/* Record that a lookup of NAME in the directory DIR found INUM (or
+   nothing if INUM is -1), unless any directory has changed since the
+   lookup began, when dcache_changes was CHANGES. */
+static void
+dcache_remember(struct fs_device *dev, u_long dir_inum, const char *name,
+		long inum, u_long changes)
+{
+    FORBID();
+    if(changes == dcache_changes)
+	dcache_set(dev, dir_inum, name, inum);
+    PERMIT();
+}
+
+/* Forget every cached name in the directory DIR-INUM of DEV, or in every
+   directory of DEV if DIR-INUM is -1. */
+static void
+dcache_purge(struct fs_device *dev, long dir_inum)
+{
+    int i;
+    FORBID();
+    dcache_changes++;
+    for(i = 0; i < DCACHE_SIZE; i++)
+    {
+	struct dcache_ent *x = &dcache_pool[i];
+	if((x->dev == dev) && ((dir_inum < 0) || (x->dir_inum == dir_inum)))
+	{
+	    dcache_unhash(x);
+	    remove_node(&x->node);
+	    append_node(&dcache_lru, &x->node);
+	}
+    }
+    PERMIT();
+}
+
+/* Drop all cached names on the device DEV. */
+void
+purge_dcache(struct fs_device *dev)
+{
+    dcache_purge(dev, -1);
+}
+
 /* Return an inode pointing at the file called NAME in the directory
    DIR, or NULL if no such file exists.
    Note that the position of DIR on exiting this function is undefined. */
@@ -30,16 +363,46 @@ find_file_entry(struct file *dir, const char *name)
 {
     long tmp;
     size_t dir_len = dir->inode->inode.size;
+    struct dir_index *index;
+    struct dcache_ent *de;
+    u_long changes;
     if(!F_IS_DIR(dir))
     {
 	ERRNO = E_NOTDIR;
 	return NULL;
     }
+    FORBID();
+    de = dcache_find(dir->inode->dev, dir->inode->inum, name, dir_hash(name));
+    if(de != NULL)
+    {
+	long inum = de->inum;
+	PERMIT();
+	if(inum < 0)
+	{
+	    ERRNO = E_NOEXIST;
+	    return NULL;
+	}
+	return make_inode(dir->inode->dev, inum);
+    }
+    changes = dcache_changes;
+    PERMIT();
+    index = get_dir_index(dir);
+    if(index != NULL)
+    {
+	u_long inum;
+	if(index_lookup(dir->inode, name, dir_hash(name), &inum) != NULL)
+	{
+	    dcache_remember(dir->inode->dev, dir->inode->inum, name, inum,
+			    changes);
+	    return make_inode(dir->inode->dev, inum);
+	}
+	goto not_found;
+    }
     seek_file(dir, 0, SEEK_ABS);
     while(dir_len > 0)
     {
 	int i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return NULL;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -47,16 +410,64 @@ find_file_entry(struct file *dir, const char *name)
 	    if((tmp_dir_blk.entries[i].name[0] != 0)
 	       && !strcmp(name, tmp_dir_blk.entries[i].name))
 	    {
+		dcache_remember(dir->inode->dev, dir->inode->inum, name,
+				tmp_dir_blk.entries[i].inum, changes);
 		return make_inode(dir->inode->dev,
 				  tmp_dir_blk.entries[i].inum);
 	    }
 	}
 	dir_len -= tmp;
     }
+not_found:
+    dcache_remember(dir->inode->dev, dir->inode->inum, name, -1, changes);
     ERRNO = E_NOEXIST;
     return NULL;
 }
 
+/* Create a new directory entry for NAME in the indexed directory DIR. */
+static bool
+create_indexed_entry(struct file *dir, const char *name,
+		     struct dir_entry *entry)
+{
+    struct dir_index *index = dir->inode->dir_index;
+    struct dir_index_ent *x;
+    u_long inum;
+    if(index_lookup(dir->inode, name, dir_hash(name), &inum) != NULL)
+    {
+	ERRNO = E_EXISTS;
+	return FALSE;
+    }
+    x = index->free_slots;
+    if(x == NULL)
+    {
+	x = malloc(sizeof(struct dir_index_ent));
+	if(x == NULL)
+	{
+	    ERRNO = E_NOMEM;
+	    return FALSE;
+	}
+	x->slot = index->nr_slots;
+    }
+    seek_file(dir, x->slot * sizeof(struct dir_entry), SEEK_ABS);
+    if(write_file(entry, sizeof(struct dir_entry), dir) < 0)
+    {
+	if(x != index->free_slots)
+	    free(x);
+	/* Who knows what state the directory is in now. */
+	free_dir_index(dir->inode);
+	return FALSE;
+    }
+    if(x == index->free_slots)
+	index->free_slots = x->next;
+    else
+	index->nr_slots++;
+    x->hash = dir_hash(entry->name);
+    x->next = index->chains[x->hash & (DIR_INDEX_BUCKETS - 1)];
+    index->chains[x->hash & (DIR_INDEX_BUCKETS - 1)] = x;
+    index->dir_size = dir->inode->inode.size;
+    return TRUE;
+}
+
 /* Create a new directory entry for the file called NAME in the directory
    DIR. It will point to the inode INUM.
    Note that the position of DIR on exiting this function is undefined. */
@@ -72,11 +483,20 @@ create_file_entry(struct file *dir, const char *name, long inum)
 	ERRNO = E_NOTDIR;
 	return FALSE;
     }
+    strncpy(tmp_entry.name, name, NAME_MAX);
+    tmp_entry.name[NAME_MAX] = 0;
+    tmp_entry.inum = inum;
+    if(get_dir_index(dir) != NULL)
+    {
+	if(!create_indexed_entry(dir, name, &tmp_entry))
+	    return FALSE;
+	goto created;
+    }
     seek_file(dir, 0, SEEK_ABS);
     while(dir_len > 0)
     {
 	int i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return tmp;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -95,10 +515,10 @@ create_file_entry(struct file *dir, const char *name, long inum)
 	seek_file(dir, free_space, SEEK_ABS);
     else
 	seek_file(dir, dir->inode->inode.size, SEEK_ABS);
-    strncpy(tmp_entry.name, name, NAME_MAX);
-    tmp_entry.inum = inum;
     if(write_file(&tmp_entry, sizeof(tmp_entry), dir) < 0)
 	return FALSE;
+created:
+    dcache_enter(dir->inode->dev, dir->inode->inum, tmp_entry.name, inum);
     return TRUE;
 }
 
@@ -111,16 +531,43 @@ delete_file_entry(struct file *dir, const char *name)
 {
     long tmp;
     size_t dir_len = dir->inode->inode.size;
+    struct dir_index *index;
     if(!F_IS_DIR(dir))
     {
 	ERRNO = E_NOTDIR;
 	return -1;
     }
+    index = get_dir_index(dir);
+    if(index != NULL)
+    {
+	u_long inum;
+	struct dir_index_ent *x, **link;
+	struct dir_entry tmp_entry;
+	link = index_lookup(dir->inode, name, dir_hash(name), &inum);
+	if(link == NULL)
+	{
+	    ERRNO = E_NOEXIST;
+	    return -1;
+	}
+	x = *link;
+	memset(&tmp_entry, 0, sizeof(tmp_entry));
+	seek_file(dir, x->slot * sizeof(struct dir_entry), SEEK_ABS);
+	if(write_file(&tmp_entry, sizeof(struct dir_entry), dir) < 0)
+	{
+	    free_dir_index(dir->inode);
+	    return -1;
+	}
+	*link = x->next;
+	x->next = index->free_slots;
+	index->free_slots = x;
+	dcache_enter(dir->inode->dev, dir->inode->inum, name, -1);
+	return inum;
+    }
     seek_file(dir, 0, SEEK_ABS);
     while(dir_len > 0)
     {
 	int i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return tmp;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -134,6 +581,7 @@ delete_file_entry(struct file *dir, const char *name)
 		tmp_dir_blk.entries[i].inum = 0;
 		if(write_file(&tmp_dir_blk.entries[i], sizeof(struct dir_entry), dir) < 0)
 		    return -1;
+		dcache_enter(dir->inode->dev, dir->inode->inum, name, -1);
 		return inum;
 	    }
 	}
@@ -255,7 +703,7 @@ directory_empty_p(struct file *dir)
     while(dir_len > 0)
     {
 	int i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return FALSE;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -449,7 +897,7 @@ create_file(const char *name, u_long attr)
 			if(create_file_entry(dir, name, inum))
 			{
 			    file->inode->inode.nlinks++;
-			    file->inode->inode.attr = attr;
+			    file->inode->inode.attr = attr & ~(ATTR_INLINE | ATTR_CLONED);
 			    file->inode->dirty = TRUE;
 			    write_inode(file->inode);
 			}
@@ -554,6 +1002,8 @@ remove_directory(const char *name)
 		inum = delete_file_entry(parent, name);
 		if(inum >= 0)
 		{
+		    /* Its i-number may be reused for something else. */
+		    dcache_purge(dir->inode->dev, dir->inode->inum);
 		    --dir->inode->inode.nlinks;
 		    dir->inode->dirty = TRUE;
 		    rc = TRUE;
@@ -603,3 +1053,54 @@ swap_current_dir(struct file *dir)
     CURRENT_DIR = dir;
     return tmp;
 }
+
+/* Read up to COUNT entries (no more than DIR_PLUS_MAX) of the directory
+   DIR from its current position into ENTS, along with the attributes,
+   size, modification time and link count of each one. The inodes are
+   looked at in order of their i-numbers so each block of the inode table
+   is read at most once. Returns the number of entries stored, zero at the
+   end of the directory, or a negative error code. */
+long
+read_dir_plus(struct file *dir, struct dir_plus *ents, int count)
+{
+    struct dir_plus *order[DIR_PLUS_MAX];
+    struct dir_entry de;
+    struct buf_head *buf = NULL;
+    struct inode inode;
+    int n = 0, i;
+    if((dir == NULL) || !F_IS_DIR(dir))
+	return -(ERRNO = E_NOTDIR);
+    count = min(count, DIR_PLUS_MAX);
+    while(n < count)
+    {
+	long len = read_file(&de, sizeof(de), dir);
+	if(len < 0)
+	    return len;
+	if(len < sizeof(de))
+	    break;
+	if(de.name[0] == 0)
+	    continue;
+	memcpy(ents[n].name, de.name, NAME_MAX + 1);
+	ents[n].inum = de.inum;
+	/* Insertion sort by i-number, there aren't many. */
+	for(i = n; (i > 0) && (order[i - 1]->inum > de.inum); i--)
+	    order[i] = order[i - 1];
+	order[i] = &ents[n];
+	n++;
+    }
+    for(i = 0; i < n; i++)
+    {
+	if(!peek_inode(dir->inode->dev, order[i]->inum, &inode, &buf))
+	{
+	    n = -ERRNO;
+	    break;
+	}
+	order[i]->attr = inode.attr;
+	order[i]->size = inode.size;
+	order[i]->modtime = inode.modtime;
+	order[i]->nlinks = inode.nlinks;
+    }
+    if(buf != NULL)
+	brelse(buf);
+    return n;
+}
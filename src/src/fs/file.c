@@ -11,6 +11,8 @@
 #ifndef TEST
 # define kprintf kernel->printf
 # define current_time kernel->current_time
+# define malloc kernel->malloc
+# define free kernel->free
 #endif
 
 static struct file file_pool[NR_FILES];
@@ -57,6 +59,8 @@ make_file(struct core_inode *inode)
     file->inode = dup_inode(inode);
     file->mode = F_READ | F_WRITE;
     file->pos = 0;
+    file->ra_next = file->ra_end = 0;
+    file->ra_window = 0;
     return file;
 }
 
@@ -129,6 +133,171 @@ seek_file(struct file *file, long arg, int type)
 	return file->pos = new_pos;
 }
 
+/* Read ahead the logical blocks START to END-1 of INODE, issuing one
+   device request for each physically contiguous run of blocks. */
+static void
+read_ahead_blocks(struct core_inode *inode, blkno start, blkno end)
+{
+    blkno run_start = 0;
+    int run_len = 0;
+    while(start < end)
+    {
+	blkno phys = get_data_blkno(inode, start, FALSE);
+	if((run_len > 0)
+	   && ((phys != run_start + run_len) || (run_len == RA_MAX_BLOCKS)))
+	{
+	    bread_ahead(inode->dev, run_start, run_len);
+	    run_len = 0;
+	}
+	if(phys != 0)
+	{
+	    if(run_len == 0)
+		run_start = phys;
+	    run_len++;
+	}
+	start++;
+    }
+    if(run_len > 0)
+	bread_ahead(inode->dev, run_start, run_len);
+}
+
+/* Called by read_file() before it reads logical block BLK of FILE. If
+   the file is being read sequentially the blocks following BLK are read
+   ahead, the number of blocks doubling each time up to RA_MAX_BLOCKS.
+   Any other access pattern resets the read-ahead window. */
+static void
+file_read_ahead(struct file *file, blkno blk)
+{
+    blkno last, end;
+    if((blk + 1) == file->ra_next)
+	return;				/* same block again */
+    if(blk != file->ra_next)
+    {
+	/* Not sequential. */
+	file->ra_next = blk + 1;
+	file->ra_end = 0;
+	file->ra_window = 0;
+	return;
+    }
+    file->ra_next = blk + 1;
+    if(file->ra_window == 0)
+	file->ra_window = RA_MIN_BLOCKS;
+    else if((file->ra_end > blk)
+	    && ((file->ra_end - blk) > (file->ra_window / 2)))
+	return;				/* still well ahead of the reader */
+    else if(file->ra_window < RA_MAX_BLOCKS)
+	file->ra_window *= 2;
+    last = (F_SIZE(file) + FS_BLKSIZ - 1) / FS_BLKSIZ;
+    end = min(blk + file->ra_window, last);
+    if(end > max(blk, file->ra_end))
+	read_ahead_blocks(file->inode, max(blk, file->ra_end), end);
+    file->ra_end = end;
+}
+
+/* Transfer LEN bytes, a multiple of FS_BLKSIZ, between BUF and FILE
+   without using the buffer cache; FILE's position must be at the start
+   of a block. Each run of physically contiguous blocks (up to
+   DIRECT_MAX_BLOCKS) is transferred by a single device request. If WRITE
+   is TRUE BUF is written to the file, otherwise it's read into.
+   Returns the number of bytes transferred, if this is less than LEN an
+   error occurred and ERRNO says what. */
+static long
+direct_transfer(void *buf, size_t len, struct file *file, bool write)
+{
+    struct core_inode *inode = file->inode;
+    long actual = 0;
+    while(len >= FS_BLKSIZ)
+    {
+	blkno blk = file->pos / FS_BLKSIZ;
+	blkno start = get_data_blkno(inode, blk, write);
+	int count = 1;
+	if(start == 0)
+	{
+	    if(write || (ERRNO != E_NOEXIST))
+		break;
+	    /* A hole in a sparse file. */
+	    memset(buf, 0, FS_BLKSIZ);
+	}
+	else
+	{
+	    while((count < DIRECT_MAX_BLOCKS)
+		  && (len >= (count + 1) * FS_BLKSIZ)
+		  && (get_data_blkno(inode, blk + count, write)
+		      == start + count))
+	    {
+		count++;
+	    }
+	    /* Keep any cached copies of the blocks coherent. */
+	    if(write)
+	    {
+		bupdate_blocks(inode->dev, start, count, buf);
+		ERRNO = FS_WRITE_BLOCKS(inode->dev, start, buf, count);
+		if(ERRNO < 0)
+		    bdirty_blocks(inode->dev, start, count);
+	    }
+	    else
+	    {
+		bflush_blocks(inode->dev, start, count);
+		ERRNO = FS_READ_BLOCKS(inode->dev, start, buf, count);
+	    }
+	    if(ERRNO < 0)
+		break;
+	    buf_stats.direct_requests++;
+	    buf_stats.direct_blocks += count;
+	}
+	buf += count * FS_BLKSIZ;
+	len -= count * FS_BLKSIZ;
+	actual += count * FS_BLKSIZ;
+	file->pos += count * FS_BLKSIZ;
+    }
+    return actual;
+}
+
+/* Returns TRUE if the data of the empty file FILE may be stored in its
+   inode as long as it stays smaller than INLINE_MAX bytes. */
+static inline bool
+inline_ok_p(struct file *file)
+{
+    int i;
+    if(F_IS_DIR(file) || (F_SIZE(file) != 0)
+       || !(file->inode->dev->features & FS_FEAT_INLINE))
+	return FALSE;
+    for(i = 0; i <= TRIPLE_INDIRECT; i++)
+    {
+	if(file->inode->inode.data[i] != 0)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/* Move the data of the inline file INODE to a data block, so that it can
+   grow past INLINE_MAX bytes. */
+static bool
+uninline_inode(struct core_inode *inode)
+{
+    u_char tmp[INLINE_MAX];
+    memcpy(tmp, INLINE_DATA(inode), INLINE_MAX);
+    memset(INLINE_DATA(inode), 0, INLINE_MAX);
+    inode->inode.attr &= ~ATTR_INLINE;
+    inode->dirty = TRUE;
+    clear_bmap_cache(inode);
+    if(inode->inode.size > 0)
+    {
+	struct buf_head *buf = get_data_block(inode, 0, TRUE);
+	if(buf == NULL)
+	{
+	    memcpy(INLINE_DATA(inode), tmp, INLINE_MAX);
+	    inode->inode.attr |= ATTR_INLINE;
+	    return FALSE;
+	}
+	memset(buf->buf->data, 0, FS_BLKSIZ);
+	memcpy(buf->buf->data, tmp, inode->inode.size);
+	bdirty(buf, FALSE);
+	brelse(buf);
+    }
+    return TRUE;
+}
+
 /* Read LEN bytes from FILE into BUF. Either the number of bytes actually
    read, or a negative error code is returned. */
 long
@@ -145,13 +314,39 @@ read_file(void *buf, size_t len, struct file *file)
 	return -ERRNO;
     if(file->inode->invalid)
 	return -(ERRNO = E_INVALID);
+    if(F_ATTR(file) & ATTR_INLINE)
+    {
+	if(file->pos < F_SIZE(file))
+	{
+	    actual = min(len, F_SIZE(file) - file->pos);
+	    memcpy(buf, INLINE_DATA(file->inode) + file->pos, actual);
+	    file->pos += actual;
+	}
+	return actual;
+    }
     while((len > 0) && (file->pos < file->inode->inode.size))
     {
 	struct buf_head *blk;
 	long this_read = min(len, FS_BLKSIZ - (file->pos % FS_BLKSIZ));
+	if((file->mode & F_DIRECT) && (this_read == FS_BLKSIZ)
+	   && (file->pos + FS_BLKSIZ <= file->inode->inode.size))
+	{
+	    /* Read as many whole blocks as possible directly. */
+	    size_t want = min(len, file->inode->inode.size - file->pos);
+	    long done;
+	    want -= want % FS_BLKSIZ;
+	    done = direct_transfer(buf, want, file, FALSE);
+	    buf += done;
+	    len -= done;
+	    actual += done;
+	    if(done < want)
+		return (actual > 0) ? actual : -ERRNO;
+	    continue;
+	}
 	if(file->pos + this_read > file->inode->inode.size)
 	    this_read = file->inode->inode.size - file->pos;
 	DB(("read_file: this_read=%d pos=%d\n", this_read, file->pos));
+	file_read_ahead(file, file->pos / FS_BLKSIZ);
 	blk = get_data_block(file->inode, file->pos / FS_BLKSIZ, FALSE);
 	if(blk == NULL)
 	{
@@ -167,7 +362,7 @@ read_file(void *buf, size_t len, struct file *file)
 	}
 	else
 	{
-	    memcpy(buf, &blk->buf.data[file->pos % FS_BLKSIZ], this_read);
+	    memcpy(buf, &blk->buf->data[file->pos % FS_BLKSIZ], this_read);
 	    brelse(blk);
 	}
 	buf += this_read;
@@ -179,6 +374,44 @@ read_file(void *buf, size_t len, struct file *file)
     return actual;
 }
 
+/* Called before FILE's current block is written, with LEN bytes still to
+   write. If the write extends the file reserve contiguous blocks for the
+   rest of it, and if the file is already a few blocks long for some more
+   writes too. */
+static inline void
+reserve_for_write(struct file *file, size_t len)
+{
+    blkno lblk = file->pos / FS_BLKSIZ;
+    if((lblk * FS_BLKSIZ >= F_SIZE(file)) && F_IS_REG(file)
+       && (file->inode->prealloc_count == 0))
+    {
+	reserve_blocks(file->inode,
+		       ((lblk > 0)
+			? get_data_blkno(file->inode, lblk - 1, FALSE) : 0),
+		       max((file->pos % FS_BLKSIZ + len + FS_BLKSIZ - 1)
+			   / FS_BLKSIZ, min(lblk, PREALLOC_BLOCKS)));
+    }
+}
+
+/* Update FILE's inode after ACTUAL bytes were written to it. */
+static inline void
+finish_write(struct file *file, long actual)
+{
+    if(file->pos > file->inode->inode.size)
+    {
+	file->inode->inode.size = file->pos;
+	file->inode->dirty = TRUE;
+    }
+    if(actual > 0)
+    {
+	file->inode->inode.modtime = current_time();
+	file->inode->dirty = TRUE;
+    }
+#if 0
+    write_inode(file->inode);
+#endif
+}
+
 /* Write LEN bytes from BUF to FILE. Either the number of bytes actually
    written, or a negative error code is returned. */
 long
@@ -193,25 +426,58 @@ write_file(const void *buf, size_t len, struct file *file)
 	return -ERRNO;
     if(file->inode->invalid)
 	return -(ERRNO = E_INVALID);
+    if(!(F_ATTR(file) & ATTR_INLINE) && (file->pos + len <= INLINE_MAX)
+       && inline_ok_p(file))
+    {
+	F_ATTR(file) |= ATTR_INLINE;
+    }
+    if(F_ATTR(file) & ATTR_INLINE)
+    {
+	if(file->pos + len <= INLINE_MAX)
+	{
+	    memcpy(INLINE_DATA(file->inode) + file->pos, buf, len);
+	    file->pos += len;
+	    actual = len;
+	    goto end;
+	}
+	if(!uninline_inode(file->inode))
+	    return -ERRNO;
+    }
     while(len > 0)
     {
 	long this_write = min(len, FS_BLKSIZ - (file->pos % FS_BLKSIZ));
-	if(this_write == FS_BLKSIZ)
+	blkno lblk = file->pos / FS_BLKSIZ;
+	reserve_for_write(file, len);
+	if((file->mode & F_DIRECT) && (this_write == FS_BLKSIZ))
+	{
+	    /* Write as many whole blocks as possible directly. */
+	    size_t want = len - (len % FS_BLKSIZ);
+	    long done = direct_transfer((void *)buf, want, file, TRUE);
+	    buf += done;
+	    len -= done;
+	    actual += done;
+	    if(done < want)
+		goto error;
+	    continue;
+	}
+	else if(this_write == FS_BLKSIZ)
 	{
 	    /* A whole block; use bwrite() to save unnecessary block
 	       reads. */
-	    blkno blk = get_data_blkno(file->inode, file->pos / FS_BLKSIZ, TRUE);
+	    blkno blk = get_data_blkno(file->inode, lblk, TRUE);
 	    if((blk == 0) || !bwrite(file->inode->dev, blk, buf))
 		goto error;
 	}
 	else
 	{
-	    struct buf_head *blk = get_data_block(file->inode,
-						  file->pos / FS_BLKSIZ, TRUE);
+	    struct buf_head *blk = get_data_block(file->inode, lblk, TRUE);
 	    if(blk != NULL)
 	    {
-		memcpy(&blk->buf.data[file->pos % FS_BLKSIZ], buf, this_write);
-		bdirty(blk, FALSE);
+		memcpy(&blk->buf->data[file->pos % FS_BLKSIZ], buf, this_write);
+		if(F_IS_DIR(file))
+		    journal_dirty(blk);
+		else
+		    bdirty(blk, FALSE);
 		brelse(blk);
 	    }
 	    else
@@ -228,26 +494,220 @@ write_file(const void *buf, size_t len, struct file *file)
 	file->pos += this_write;
     }
 end:
-    if(file->pos > file->inode->inode.size)
+    finish_write(file, actual);
+    return actual;
+}
+
+/* Vectored I/O.
+
+   read_file_vec() and write_file_vec() transfer data between a file and
+   a list of segments of memory as a single operation: each block of the
+   file is found once and all the pieces of the segments falling into it
+   are copied in or out of the same buffer. A whole block gathered from
+   several segments is written with bwrite_vec(), so it's never read. */
+
+/* The position reached in a list of segments. */
+struct iov_pos {
+    const struct fs_iovec *iov;
+    int count;				/* segments left, including IOV */
+    size_t off;				/* bytes of IOV already done */
+};
+
+/* Move P past any used-up segments. */
+static inline void
+iov_skip(struct iov_pos *p)
+{
+    while((p->count > 0) && (p->off >= p->iov->len))
     {
-	file->inode->inode.size = file->pos;
-	file->inode->dirty = TRUE;
+	p->iov++;
+	p->count--;
+	p->off = 0;
     }
-    if(actual > 0)
+}
+
+/* Copy LEN bytes between DATA and the segments at P, advancing P. If
+   TO_IOV is TRUE the bytes are copied into the segments (zeros if DATA
+   is a null pointer), otherwise they're copied out of them (or skipped
+   if DATA is a null pointer). */
+static void
+iov_copy(struct iov_pos *p, u_char *data, size_t len, bool to_iov)
+{
+    while(len > 0)
     {
-	file->inode->inode.modtime = current_time();
-	file->inode->dirty = TRUE;
+	size_t this;
+	u_char *seg;
+	iov_skip(p);
+	if(p->count == 0)
+	    break;
+	this = min(len, p->iov->len - p->off);
+	seg = (u_char *)p->iov->base + p->off;
+	if(to_iov)
+	{
+	    if(data != NULL)
+		memcpy(seg, data, this);
+	    else
+		memset(seg, 0, this);
+	}
+	else if(data != NULL)
+	    memcpy(data, seg, this);
+	if(data != NULL)
+	    data += this;
+	p->off += this;
+	len -= this;
+    }
+}
+
+/* Check the COUNT segments IOV, returning the total number of bytes in
+   them or -1 if they're invalid. */
+static long
+iov_length(const struct fs_iovec *iov, int count)
+{
+    long total = 0;
+    if((iov == NULL) || (count < 0))
+	return -1;
+    while(count-- > 0)
+    {
+	if((long)(total + iov->len) < total)
+	    return -1;
+	total += (iov++)->len;
+    }
+    return total;
+}
+
+/* Transfer each segment in turn with read_file() or write_file(), for
+   the cases those functions handle specially. */
+static long
+file_vec_by_seg(const struct fs_iovec *iov, int count, struct file *file,
+		bool write)
+{
+    long actual = 0;
+    while(count-- > 0)
+    {
+	long done = (write ? write_file(iov->base, iov->len, file)
+		     : read_file(iov->base, iov->len, file));
+	if(done < 0)
+	    return (actual > 0) ? actual : done;
+	actual += done;
+	if(done < iov->len)
+	    break;
+	iov++;
     }
-#if 0
-    write_inode(file->inode);
-#endif
+    return actual;
+}
+
+/* Read from FILE into the COUNT segments IOV, filling each before
+   starting the next. Returns the number of bytes read or a negative
+   error code. */
+long
+read_file_vec(const struct fs_iovec *iov, int count, struct file *file)
+{
+    struct iov_pos p;
+    long len = iov_length(iov, count), actual = 0;
+    if((file == NULL) || (len < 0))
+	return -(ERRNO = E_BADARG);
+    if(!(file->mode & F_READ))
+	return -(ERRNO = E_PERM);
+    if(!test_media(file->inode->dev))
+	return -ERRNO;
+    if(file->inode->invalid)
+	return -(ERRNO = E_INVALID);
+    if((F_ATTR(file) & ATTR_INLINE) || (file->mode & F_DIRECT))
+	return file_vec_by_seg(iov, count, file, FALSE);
+    p.iov = iov;
+    p.count = count;
+    p.off = 0;
+    while((len > 0) && (file->pos < F_SIZE(file)))
+    {
+	struct buf_head *blk;
+	long this_read = min(len, FS_BLKSIZ - (file->pos % FS_BLKSIZ));
+	if(file->pos + this_read > F_SIZE(file))
+	    this_read = F_SIZE(file) - file->pos;
+	file_read_ahead(file, file->pos / FS_BLKSIZ);
+	blk = get_data_block(file->inode, file->pos / FS_BLKSIZ, FALSE);
+	if(blk == NULL)
+	{
+	    if(ERRNO != E_NOEXIST)
+		return (actual > 0) ? actual : -ERRNO;
+	    /* A hole in a sparse file. */
+	    iov_copy(&p, NULL, this_read, TRUE);
+	}
+	else
+	{
+	    iov_copy(&p, &blk->buf->data[file->pos % FS_BLKSIZ],
+		     this_read, TRUE);
+	    brelse(blk);
+	}
+	len -= this_read;
+	actual += this_read;
+	file->pos += this_read;
+    }
+    return actual;
+}
+
+/* Write the COUNT segments IOV to FILE, one after the other. Returns the
+   number of bytes written or a negative error code. */
+long
+write_file_vec(const struct fs_iovec *iov, int count, struct file *file)
+{
+    struct iov_pos p;
+    long len = iov_length(iov, count), actual = 0;
+    if((file == NULL) || (len < 0))
+	return -(ERRNO = E_BADARG);
+    if(!(file->mode & F_WRITE))
+	return -(ERRNO = E_PERM);
+    if(!test_media(file->inode->dev))
+	return -ERRNO;
+    if(file->inode->invalid)
+	return -(ERRNO = E_INVALID);
+    if((F_ATTR(file) & ATTR_INLINE) || (file->mode & F_DIRECT)
+       || F_IS_DIR(file)
+       || ((file->pos + len <= INLINE_MAX) && inline_ok_p(file)))
+    {
+	return file_vec_by_seg(iov, count, file, TRUE);
+    }
+    p.iov = iov;
+    p.count = count;
+    p.off = 0;
+    while(len > 0)
+    {
+	long this_write = min(len, FS_BLKSIZ - (file->pos % FS_BLKSIZ));
+	blkno lblk = file->pos / FS_BLKSIZ;
+	reserve_for_write(file, len);
+	if(this_write == FS_BLKSIZ)
+	{
+	    /* A whole block, no need to read it first. */
+	    blkno blk = get_data_blkno(file->inode, lblk, TRUE);
+	    iov_skip(&p);
+	    if((blk == 0)
+	       || !bwrite_vec(file->inode->dev, blk, p.iov, p.count, p.off))
+		break;
+	    iov_copy(&p, NULL, FS_BLKSIZ, FALSE);
+	}
+	else
+	{
+	    struct buf_head *blk = get_data_block(file->inode, lblk, TRUE);
+	    if(blk == NULL)
+		break;
+	    iov_copy(&p, &blk->buf->data[file->pos % FS_BLKSIZ],
+		     this_write, FALSE);
+	    bdirty(blk, FALSE);
+	    brelse(blk);
+	}
+	len -= this_write;
+	actual += this_write;
+	file->pos += this_write;
+    }
+    if((len > 0) && (actual == 0))
+	actual = -ERRNO;
+    finish_write(file, actual);
     return actual;
 }
 
 static bool
 delete_indirect_blocks(struct core_inode *inode, blkno blk, int depth)
 {
-    struct buf_head *ind_blk = bread(inode->dev, blk);
+    struct buf_head *ind_blk = bread_class(inode->dev, blk,
+					   BUF_CLASS_INDIRECT);
     bool rc = TRUE;
     int i;
     if(ind_blk == NULL)
@@ -259,24 +719,26 @@ delete_indirect_blocks(struct core_inode *inode, blkno blk, int depth)
     }
     for(i = 0; i < PTRS_PER_INDIRECT; i++)
     {
-	if(ind_blk->buf.ind.data[i] != 0)
+	if(ind_blk->buf->ind.data[i] != 0)
 	{
 	    if(depth == 0)
-		free_block(inode->dev, ind_blk->buf.ind.data[i]);
+		free_block(inode->dev, ind_blk->buf->ind.data[i]);
 	    else
 	    {
-		if(!delete_indirect_blocks(inode, ind_blk->buf.ind.data[i],
+		if(!delete_indirect_blocks(inode, ind_blk->buf->ind.data[i],
 					   depth - 1))
 		{
 		    rc = FALSE;
 		    break;
 		}
 	    }
-	    ind_blk->buf.ind.data[i] = 0;
+	    ind_blk->buf->ind.data[i] = 0;
 	    bdirty(ind_blk, FALSE);
 	}
     }
     brelse(ind_blk);
+    if(rc)
+	free_block(inode->dev, blk);
     return rc;
 }
 
@@ -294,6 +756,12 @@ delete_inode_data(struct core_inode *inode)
 	ERRNO = E_INVALID;
 	return FALSE;
     }
+    release_blocks(inode);
+    if(inode->inode.attr & ATTR_INLINE)
+    {
+	memset(INLINE_DATA(inode), 0, INLINE_MAX);
+	inode->inode.attr &= ~ATTR_INLINE;
+    }
     for(i = 0; i < SINGLE_INDIRECT; i++)
     {
 	if(inode->inode.data[i] != 0)
@@ -321,6 +789,7 @@ delete_inode_data(struct core_inode *inode)
 				    2);
 	inode->inode.data[TRIPLE_INDIRECT] = 0;
     }
+    clear_bmap_cache(inode);
     inode->inode.size = 0;
     inode->inode.modtime = current_time();
     inode->dirty = TRUE;
@@ -345,12 +814,252 @@ set_file_size(struct file *file, size_t size)
 {
     if(file == NULL)
 	return ERRNO = E_BADARG;
+    if(F_ATTR(file) & ATTR_INLINE)
+    {
+	if(size > INLINE_MAX)
+	{
+	    if(!uninline_inode(file->inode))
+		return FALSE;
+	}
+	else if(size < F_SIZE(file))
+	{
+	    /* Bytes past the end of an inline file are always zero. */
+	    memset(INLINE_DATA(file->inode) + size, 0, INLINE_MAX - size);
+	}
+    }
     F_SIZE(file) = size;
     file->inode->dirty = TRUE;
     write_inode(file->inode);
     return TRUE;
 }
 
+/* Extend FILE to SIZE bytes, allocating the new blocks in as few runs as
+   possible and filling them with zeros. This is for files that will be
+   written in a random order, such as disk images, so that they're laid
+   out contiguously. Returns FALSE if an error occurred, the file may
+   still have been extended part of the way. */
+bool
+preallocate_file(struct file *file, size_t size)
+{
+    struct core_inode *inode;
+    void *zeros;
+    u_long old_pos;
+    blkno blk, end;
+    bool rc = TRUE;
+    if(file == NULL)
+	return ERRNO = E_BADARG;
+    if(!(file->mode & F_WRITE))
+	return ERRNO = E_PERM;
+    if(!test_media(file->inode->dev))
+	return FALSE;
+    inode = file->inode;
+    if(inode->invalid)
+	return ERRNO = E_INVALID;
+    if(size <= F_SIZE(file))
+	return TRUE;
+    if(F_ATTR(file) & ATTR_INLINE)
+    {
+	if(size <= INLINE_MAX)
+	    return set_file_size(file, size);
+	if(!uninline_inode(inode))
+	    return FALSE;
+    }
+    zeros = malloc(DIRECT_MAX_BLOCKS * FS_BLKSIZ);
+    if(zeros == NULL)
+	return ERRNO = E_NOMEM;
+    memset(zeros, 0, DIRECT_MAX_BLOCKS * FS_BLKSIZ);
+    if((F_SIZE(file) % FS_BLKSIZ) != 0)
+    {
+	/* The tail of the last block is about to become part of the
+	   file, it has to read as zeros. */
+	struct buf_head *buf = get_data_block(inode, F_SIZE(file) / FS_BLKSIZ,
+					      FALSE);
+	if(buf != NULL)
+	{
+	    memset(&buf->buf->data[F_SIZE(file) % FS_BLKSIZ], 0,
+		   FS_BLKSIZ - (F_SIZE(file) % FS_BLKSIZ));
+	    bdirty(buf, FALSE);
+	    brelse(buf);
+	}
+    }
+    old_pos = file->pos;
+    blk = (F_SIZE(file) + FS_BLKSIZ - 1) / FS_BLKSIZ;
+    end = (size + FS_BLKSIZ - 1) / FS_BLKSIZ;
+    file->pos = blk * FS_BLKSIZ;
+    while(blk < end)
+    {
+	u_long count = min(end - blk, DIRECT_MAX_BLOCKS);
+	if(!reserve_blocks(inode, ((blk > 0)
+				   ? get_data_blkno(inode, blk - 1, FALSE) : 0),
+			   end - blk)
+	   || (direct_transfer(zeros, count * FS_BLKSIZ, file, TRUE)
+	       < (count * FS_BLKSIZ)))
+	{
+	    rc = FALSE;
+	    break;
+	}
+	blk += count;
+    }
+    F_SIZE(file) = min(size, file->pos);
+    inode->inode.modtime = current_time();
+    inode->dirty = TRUE;
+    file->pos = old_pos;
+    free(zeros);
+    write_inode(inode);
+    return rc;
+}
+
+/* Replace the indirect block *BLKP (of depth DEPTH, zero for a single
+   indirect block) of the clone INODE by a copy of it, sharing the data
+   blocks it points to. If an error occurs FALSE is returned, *BLKP is
+   then either zero or a partial copy that can be deleted as usual. */
+static bool
+clone_indirect(struct core_inode *inode, blkno *blkp, int depth)
+{
+    struct buf_head *buf;
+    blkno *ptrs, copy;
+    bool rc = TRUE;
+    int i;
+    buf = bread_class(inode->dev, *blkp, BUF_CLASS_INDIRECT);
+    if(buf == NULL)
+	goto fail;
+    ptrs = malloc(FS_BLKSIZ);
+    if(ptrs == NULL)
+    {
+	brelse(buf);
+	ERRNO = E_NOMEM;
+	goto fail;
+    }
+    memcpy(ptrs, buf->buf->ind.data, FS_BLKSIZ);
+    brelse(buf);
+    copy = alloc_block(inode->dev, *blkp);
+    if(copy == 0)
+    {
+	free(ptrs);
+	goto fail;
+    }
+    for(i = 0; i < PTRS_PER_INDIRECT; i++)
+    {
+	if(ptrs[i] == 0)
+	    continue;
+	if(depth == 0)
+	    rc = share_block(inode->dev, ptrs[i]);
+	else if(!clone_indirect(inode, &ptrs[i], depth - 1))
+	{
+	    /* Keep the partial copy. */
+	    i++;
+	    rc = FALSE;
+	}
+	if(!rc)
+	{
+	    /* Nothing from here on has been shared. */
+	    memset(&ptrs[i], 0, (PTRS_PER_INDIRECT - i) * sizeof(blkno));
+	    break;
+	}
+    }
+    if(!bwrite(inode->dev, copy, ptrs))
+    {
+	free_block(inode->dev, copy);
+	copy = 0;
+	rc = FALSE;
+    }
+    free(ptrs);
+    *blkp = copy;
+    return rc;
+
+fail:
+    *blkp = 0;
+    return FALSE;
+}
+
+/* Create a new file called NAME with the same contents as the regular
+   file SRC, without copying them: the two files share SRC's data blocks
+   (only its indirect blocks are copied) and each block is copied the
+   first time either file writes to it. SRC's device must have block
+   reference counts (FS_FEAT_REFCOUNT) and NAME must be on the same
+   device. Returns a handle on the new file, or NULL. */
+struct file *
+clone_file(const char *name, struct file *src)
+{
+    struct core_inode *from, *to;
+    struct file *dst;
+    bool rc = TRUE;
+    int i;
+    if((src == NULL) || !F_IS_REG(src))
+    {
+	ERRNO = E_BADARG;
+	return NULL;
+    }
+    if(!test_media(src->inode->dev))
+	return NULL;
+    from = src->inode;
+    if(from->invalid)
+    {
+	ERRNO = E_INVALID;
+	return NULL;
+    }
+    if(!(from->dev->features & FS_FEAT_REFCOUNT))
+    {
+	ERRNO = E_BADARG;
+	return NULL;
+    }
+    dst = create_file(name, from->inode.attr & ATTR_MODE_MASK);
+    if(dst == NULL)
+	return NULL;
+    to = dst->inode;
+    if(to->dev != from->dev)
+    {
+	ERRNO = E_XDEV;
+	goto error;
+    }
+    memcpy(to->inode.data, from->inode.data, sizeof(to->inode.data));
+    if(from->inode.attr & ATTR_INLINE)
+	to->inode.attr |= ATTR_INLINE;
+    else
+    {
+	for(i = 0; i <= TRIPLE_INDIRECT; i++)
+	{
+	    if(to->inode.data[i] == 0)
+		continue;
+	    if(i < SINGLE_INDIRECT)
+		rc = share_block(to->dev, to->inode.data[i]);
+	    else if(!clone_indirect(to, &to->inode.data[i],
+				    i - SINGLE_INDIRECT))
+	    {
+		i++;
+		rc = FALSE;
+	    }
+	    if(!rc)
+	    {
+		memset(&to->inode.data[i], 0,
+		       (TRIPLE_INDIRECT + 1 - i) * sizeof(blkno));
+		break;
+	    }
+	}
+	to->inode.attr |= ATTR_CLONED;
+	from->inode.attr |= ATTR_CLONED;
+	from->dirty = TRUE;
+	write_inode(from);
+    }
+    to->inode.size = from->inode.size;
+    to->dirty = TRUE;
+    if(rc)
+    {
+	write_inode(to);
+	return dst;
+    }
+error:
+    {
+	/* Give back everything shared so far. */
+	int err = ERRNO;
+	delete_inode_data(to);
+	close_file(dst);
+	remove_link(name);
+	ERRNO = err;
+    }
+    return NULL;
+}
+
 bool
 set_file_modes(const char *name, u_long mode)
 {
@@ -358,7 +1067,7 @@ set_file_modes(const char *name, u_long mode)
     if(file != NULL)
     {
 	file->inode->inode.attr &= ~ATTR_MODE_MASK;
-	file->inode->inode.attr |= (mode & ~ATTR_MODE_MASK);
+	file->inode->inode.attr |= (mode & ATTR_MODE_MASK);
 	file->inode->dirty = TRUE;
 	close_file(file);
 	return TRUE;
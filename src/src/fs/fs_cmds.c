@@ -5,6 +5,7 @@
 # include <unistd.h>
 # include <fcntl.h>
 # include <stdio.h>
+# include <stdlib.h>
 # define __NO_TYPE_CLASHES
 #endif
 
@@ -19,35 +20,48 @@
 #ifndef TEST
 # define current_time kernel->current_time
 # define expand_time kernel->expand_time
+# define strtoul kernel->strtoul
+# define malloc kernel->malloc
+# define free kernel->free
 # define SHELL sh->shell
 #else
 # define SHELL shell
 #endif
 
 #define DOC_cp "cp SOURCE-FILE DEST-FILE\n\
-Copy the file SOURCE-FILE to the file DEST-FILE."
+Copy the file SOURCE-FILE to the file DEST-FILE. The data is copied\n\
+directly between the devices, without using the buffer cache."
 int
 cmd_cp(struct shell *sh, int argc, char **argv)
 {
     int rc = RC_FAIL;
     if(argc == 2)
     {
-	struct file *src = open_file(argv[0], F_READ);
+	struct file *src = open_file(argv[0], F_READ | F_DIRECT);
 	if(src != NULL)
 	{
-	    struct file *dst = open_file(argv[1],
-					 F_WRITE | F_TRUNCATE | F_CREATE);
+	    struct file *dst = open_file(argv[1], F_WRITE | F_TRUNCATE
+					 | F_CREATE | F_DIRECT);
 	    if(dst != NULL)
 	    {
 		int actual;
+		/* Without memory for a big buffer copy through the cache
+		   in pieces small enough for the stack. */
+		u_char small_buf[512];
+		u_char *buf = malloc(DIRECT_MAX_BLOCKS * FS_BLKSIZ);
+		size_t buf_size = DIRECT_MAX_BLOCKS * FS_BLKSIZ;
+		if(buf == NULL)
+		{
+		    buf = small_buf;
+		    buf_size = sizeof(small_buf);
+		}
 		rc = RC_OK;
 		do {
 		    int wrote;
-		    u_char buf[FS_BLKSIZ];
-		    actual = read_file(&buf, FS_BLKSIZ, src);
+		    actual = read_file(buf, buf_size, src);
 		    if(actual < 0)
 			goto error;
-		    wrote = write_file(&buf, actual, dst);
+		    wrote = write_file(buf, actual, dst);
 		    if(wrote != actual)
 		    {
 		    error:
@@ -56,6 +70,8 @@ cmd_cp(struct shell *sh, int argc, char **argv)
 			break;
 		    }
 		} while(actual > 0);
+		if(buf != small_buf)
+		    free(buf);
 		close_file(dst);
 	    }
 	    else
@@ -76,6 +92,14 @@ int
 cmd_type(struct shell *sh, int argc, char **argv)
 {
     int rc = RC_OK;
+    /* Not on the stack, a block may be 4K. */
+    u_char *buf = malloc(FS_BLKSIZ);
+    if(buf == NULL)
+    {
+	ERRNO = E_NOMEM;
+	SHELL->perror(sh, "type");
+	return RC_FAIL;
+    }
     while(rc == RC_OK && argc > 0)
     {
 	struct file *f = open_file(*argv, F_READ);
@@ -83,15 +107,14 @@ cmd_type(struct shell *sh, int argc, char **argv)
 	{
 	    int actual;
 	    do {
-		u_char buf[FS_BLKSIZ];
-		actual = read_file(&buf, FS_BLKSIZ, f);
+		actual = read_file(buf, FS_BLKSIZ, f);
 		if(actual < 0)
 		{
 		    SHELL->perror(sh, argv[0]);
 		    rc = RC_FAIL;
 		    break;
 		}
-		SHELL->print(sh, (char *)&buf, actual);
+		SHELL->print(sh, (char *)buf, actual);
 	    } while(actual > 0);
 	    close_file(f);
 	    argc--; argv++;
@@ -102,6 +125,7 @@ cmd_type(struct shell *sh, int argc, char **argv)
 	    rc = RC_FAIL;
 	}
     }
+    free(buf);
     return rc;
 }
 
@@ -121,6 +145,9 @@ decode_attributes(u_long attr)
 #define DOC_ls "ls [OPTIONS...] [DIRECTORY]\n\
 Prints a listing of the directory DIRECTORY (or the current directory)\n\
 using the options OPTIONS (currently there are no options!)."
+/* Number of entries read by each read_dir_plus() call; they're on the
+   stack. */
+#define LS_BATCH 16
 int
 cmd_ls(struct shell *sh, int argc, char **argv)
 {
@@ -145,35 +172,33 @@ cmd_ls(struct shell *sh, int argc, char **argv)
     while(1)
     {
 	int i;
-	struct dir_entry_blk dir_blk;
-	entries = read_file(&dir_blk, FS_BLKSIZ, dir);
+	struct dir_plus ents[LS_BATCH];
+	entries = read_dir_plus(dir, ents, LS_BATCH);
 	if(entries < 0)
 	    goto error;
 	if(entries == 0)
 	    goto end;
-	entries /= sizeof(struct dir_entry);
 	for(i = 0; i < entries; i++)
 	{
-	    struct core_inode *inode;
-	    if(dir_blk.entries[i].name[0] == 0)
-		continue;
-	    inode = make_inode(dir->inode->dev, dir_blk.entries[i].inum);
-	    if(inode != NULL)
+	    struct time_bits tm;
+	    expand_time(ents[i].modtime, &tm);
+	    SHELL->printf(sh,
+			  "%5d %s %2d %8d  %s %2d %02d:%02d  %s",
+			  ents[i].inum,
+			  decode_attributes(ents[i].attr),
+			  ents[i].nlinks,
+			  ents[i].size,
+			  tm.month_abbrev,
+			  tm.day,
+			  tm.hour,
+			  tm.minute,
+			  ents[i].name);
+	    if(ents[i].attr & ATTR_SYMLINK)
 	    {
-		struct time_bits tm;
-		expand_time(inode->inode.modtime, &tm);
-		SHELL->printf(sh,
-			      "%5d %s %2d %8d  %s %2d %02d:%02d  %s",
-			      inode->inum,
-			      decode_attributes(inode->inode.attr),
-			      inode->inode.nlinks,
-			      inode->inode.size,
-			      tm.month_abbrev,
-			      tm.day,
-			      tm.hour,
-			      tm.minute,
-			      dir_blk.entries[i].name);
-		if(inode->inode.attr & ATTR_SYMLINK)
+		/* Only symbolic links need their inodes opening. */
+		struct core_inode *inode = make_inode(dir->inode->dev,
+						      ents[i].inum);
+		if(inode != NULL)
 		{
 		    struct file *link = make_file(inode);
 		    if(link != NULL)
@@ -183,10 +208,10 @@ cmd_ls(struct shell *sh, int argc, char **argv)
 			SHELL->printf(sh, " -> %s", buf);
 			close_file(link);
 		    }
+		    close_inode(inode);
 		}
-		SHELL->printf(sh, "\n");
-		close_inode(inode);
 	    }
+	    SHELL->printf(sh, "\n");
 	}
     }
 error:
@@ -342,13 +367,64 @@ cmd_mv(struct shell *sh, int argc, char **argv)
     SHELL->perror(sh, argv[1]);
     return RC_OK;
 }
+
+#define DOC_prealloc "prealloc FILE SIZE\n\
+Extend FILE (creating it if necessary) to SIZE bytes of zeros, storing\n\
+them in as few contiguous runs of blocks as possible."
+int
+cmd_prealloc(struct shell *sh, int argc, char **argv)
+{
+    struct file *file;
+    int rc = RC_OK;
+    if(argc != 2)
+	return SHELL->arg_error(sh);
+    file = open_file(argv[0], F_READ | F_WRITE | F_CREATE);
+    if(file == NULL)
+    {
+	SHELL->perror(sh, argv[0]);
+	return RC_FAIL;
+    }
+    if(!preallocate_file(file, strtoul(argv[1], NULL, 0)))
+    {
+	SHELL->perror(sh, argv[0]);
+	rc = RC_FAIL;
+    }
+    close_file(file);
+    return rc;
+}
+
+#define DOC_clone "clone SOURCE-FILE DEST-FILE\n\
+Create DEST-FILE as a copy of SOURCE-FILE which shares its data blocks,\n\
+each block is only copied when one of the files is written to."
+int
+cmd_clone(struct shell *sh, int argc, char **argv)
+{
+    struct file *src, *dst;
+    if(argc != 2)
+	return SHELL->arg_error(sh);
+    src = open_file(argv[0], F_READ);
+    if(src == NULL)
+    {
+	SHELL->perror(sh, argv[0]);
+	return RC_FAIL;
+    }
+    dst = clone_file(argv[1], src);
+    close_file(src);
+    if(dst == NULL)
+    {
+	SHELL->perror(sh, argv[1]);
+	return RC_FAIL;
+    }
+    close_file(dst);
+    return RC_OK;
+}
 	
 static inline void
 print_devinfo(struct shell *sh, struct fs_device *dev)
 {
-    SHELL->printf(sh, "%10s  %8d  %8d  %8d\n",
+    SHELL->printf(sh, "%10s  %8d  %8d  %8d  %8d\n",
 		  dev->name, dev->sup.total_blocks,
-		  used_blocks(dev), dev->use_count);
+		  used_blocks(dev), used_inodes(dev), dev->use_count);
 }
 #define DOC_devinfo "devinfo [DEVICE-NAME]\n\
 If DEVICE-NAME is not specified, prints some information about all\n\
@@ -358,8 +434,8 @@ int
 cmd_devinfo(struct shell *sh, int argc, char **argv)
 {
     int rc = RC_OK;
-    SHELL->printf(sh, "%10s  %8s  %8s  %8s\n",
-		  "Device", "Blocks", "Used", "Users");
+    SHELL->printf(sh, "%10s  %8s  %8s  %8s  %8s\n",
+		  "Device", "Blocks", "Used", "Inodes", "Users");
     if(argc == 1)
     {
 	struct fs_device *dev;
@@ -404,21 +480,21 @@ cmd_ucp(struct shell *sh, int argc, char **argv)
 	{
 	    struct file *dst = open_file(argv[1],
 					 F_WRITE | F_TRUNCATE | F_CREATE);
-	    if(dst != NULL)
+	    u_char *buf = malloc(FS_BLKSIZ);
+	    if((dst != NULL) && (buf != NULL))
 	    {
 		int actual;
 		rc = RC_OK;
 		do {
 		    int wrote;
-		    u_char buf[FS_BLKSIZ];
-		    actual = read(src_fd, &buf, FS_BLKSIZ);
+		    actual = read(src_fd, buf, FS_BLKSIZ);
 		    if(actual < 0)
 		    {
 			perror(argv[0]);
 			rc = RC_FAIL;
 			break;
 		    }
-		    wrote = write_file(&buf, actual, dst);
+		    wrote = write_file(buf, actual, dst);
 		    if(wrote != actual)
 		    {
 			SHELL->perror(sh, argv[1]);
@@ -426,8 +502,10 @@ cmd_ucp(struct shell *sh, int argc, char **argv)
 			break;
 		    }
 		} while(actual > 0);
-		close_file(dst);
 	    }
+	    if(dst != NULL)
+		close_file(dst);
+	    free(buf);
 	    close(src_fd);
 	}
     }
@@ -442,10 +520,145 @@ Display some information about buffer-cache usage."
 int
 cmd_bufstats(struct shell *sh, int argc, char **argv)
 {
+    static const char *class_names[BUF_NR_CLASSES] = {
+	"data", "directory", "indirect", "inode", "bitmap"
+    };
+    struct buffer_stats st;
+    struct fs_device *dev;
+    int i;
+    get_buffer_stats(&st);
     SHELL->printf(sh, "  Total block accesses: %-8d\n"
 		  "       Cached accesses: %-8d\n"
-		  "Discarded dirty blocks: %-8d\n",
-		  total_accessed, cached_accesses, dirty_accesses);
+		  "Discarded dirty blocks: %-8d\n"
+		  "     Buffers allocated: %-8d\n"
+		  "     Hash table chains: %-8d\n"
+		  "  Active/inactive/free: %d/%d/%d\n"
+		  "             Evictions: %-8d (%d active)\n"
+		  "   Direct I/O requests: %-8d (%d blocks)\n",
+		  st.total_accessed, st.cached_accesses, st.dirty_accesses,
+		  st.nr_buffers, st.hash_size,
+		  st.list_len[BUF_ACTIVE], st.list_len[BUF_INACTIVE],
+		  st.list_len[BUF_FREE], st.evictions, st.active_evictions,
+		  st.direct_requests, st.direct_blocks);
+    SHELL->printf(sh, "   Read-ahead requests: %-8d (%d blocks)\n"
+		  "  Read-ahead hit/waste: %d/%d\n",
+		  st.ra_requests, st.ra_blocks, st.ra_hits, st.ra_wasted);
+    if(st.evictions > 0)
+    {
+	SHELL->printf(sh, "     Mean eviction age: %-8d\n"
+		      "      Min eviction age: %-8d\n",
+		      st.evict_age_total / st.evictions, st.evict_age_min);
+    }
+    SHELL->printf(sh, "         Dirty buffers: %-8d\n", st.nr_dirty);
+    if(st.nr_dirty > 0)
+    {
+	SHELL->printf(sh, "        Mean dirty age: %-8d ticks\n"
+		      "         Max dirty age: %-8d ticks\n",
+		      st.dirty_age_total / st.nr_dirty, st.dirty_age_max);
+    }
+    SHELL->printf(sh, "    Bucket locks/waits: %d/%d\n"
+		  "     Buffer lock waits: %-8d\n"
+		  "   Lock wait total/max: %d/%d ticks\n"
+		  "   Lock hold total/max: %d/%d ticks\n",
+		  st.bucket_locks_taken, st.bucket_lock_waits,
+		  st.buffer_lock_waits, st.lock_wait_total, st.lock_wait_max,
+		  st.lock_hold_total, st.lock_hold_max);
+    SHELL->printf(sh, " In-core/cached inodes: %d/%d\n"
+		  "     Inode hits/misses: %d/%d (%d recycled)\n"
+		  " Block map hits/misses: %d/%d\n"
+		  "  Shared blocks copied: %-8d\n",
+		  inode_stats.nr_inodes, inode_stats.nr_cached,
+		  inode_stats.hits, inode_stats.misses, inode_stats.recycled,
+		  inode_stats.bmap_hits, inode_stats.bmap_misses,
+		  inode_stats.cow_copies);
+
+    SHELL->printf(sh, "\nRead latency (ticks):");
+    for(i = 0; i < BUF_LATENCY_BUCKETS; i++)
+    {
+	if(i == 0)
+	    SHELL->printf(sh, "  0:%d", st.read_latency[i]);
+	else if(i == BUF_LATENCY_BUCKETS - 1)
+	    SHELL->printf(sh, "  %d+:%d", 1 << (i - 1), st.read_latency[i]);
+	else
+	    SHELL->printf(sh, "  %d-%d:%d", 1 << (i - 1), (1 << i) - 1,
+			  st.read_latency[i]);
+    }
+
+    SHELL->printf(sh, "\n\n%10s  %8s  %8s  %8s\n",
+		  "Class", "Buffers", "Hits", "Misses");
+    for(i = 0; i < BUF_NR_CLASSES; i++)
+    {
+	SHELL->printf(sh, "%10s  %8d  %8d  %8d\n", class_names[i],
+		      st.class_len[i], st.class_hits[i], st.class_misses[i]);
+    }
+
+    SHELL->printf(sh, "\n%10s  %8s  %8s  %8s  %8s  %8s\n",
+		  "Device", "Hits", "Misses", "Evicted", "Reads", "Writes");
+    for(dev = device_list; dev != NULL; dev = dev->next)
+    {
+	struct fs_dev_stats ds;
+	get_device_stats(dev, &ds);
+	SHELL->printf(sh, "%10s  %8d  %8d  %8d  %8d  %8d\n", dev->name,
+		      ds.hits, ds.misses, ds.evictions,
+		      ds.blocks_read, ds.blocks_written);
+    }
+    return RC_OK;
+}
+
+#define DOC_bdflush "bdflush [-interval TICKS] [-age TICKS] [-ratio PCT] [-limit PCT]\n\
+Set and display the parameters of the buffer write-back task. Every\n\
+TICKS timer ticks it writes the buffers that have been dirty for at\n\
+least -age ticks, and more if over -ratio percent of the cache is dirty.\n\
+Past -limit percent tasks releasing dirty buffers write them themselves."
+int
+cmd_bdflush(struct shell *sh, int argc, char **argv)
+{
+    struct buffer_stats st;
+    while(argc >= 2)
+    {
+	u_long val = strtoul(argv[1], NULL, 0);
+	if(!strcmp("-interval", argv[0]) && (val > 0))
+	    bdflush_interval = val;
+	else if(!strcmp("-age", argv[0]))
+	    bdflush_age = val;
+	else if(!strcmp("-ratio", argv[0]) && (val <= 100))
+	    bdflush_ratio = val;
+	else if(!strcmp("-limit", argv[0]) && (val <= 100))
+	    bdflush_limit = val;
+	else
+	    return SHELL->arg_error(sh);
+	argc -= 2; argv += 2;
+    }
+    if(argc != 0)
+	return SHELL->arg_error(sh);
+    get_buffer_stats(&st);
+    SHELL->printf(sh, "              Interval: %-8d ticks\n"
+		  "             Dirty age: %-8d ticks\n"
+		  "      Background ratio: %d%%\n"
+		  "      Foreground limit: %d%%\n"
+		  "         Dirty buffers: %-8d\n"
+		  "          Flusher runs: %-8d\n"
+		  "        Blocks written: %-8d (%d requests)\n"
+		  "      Throttled writes: %-8d\n",
+		  bdflush_interval, bdflush_age, bdflush_ratio, bdflush_limit,
+		  st.nr_dirty, st.bdflush_runs, st.flushed_blocks,
+		  st.write_requests, st.throttled_writes);
+    if(st.flushed_blocks > 0)
+    {
+	SHELL->printf(sh, "       Mean write wait: %-8d ticks\n"
+		      "        Max write wait: %-8d ticks\n",
+		      st.write_wait_total / st.flushed_blocks,
+		      st.write_wait_max);
+    }
+    return RC_OK;
+}
+
+#define DOC_sync "sync\n\
+Write all modified buffers to their devices."
+int
+cmd_sync(struct shell *sh, int argc, char **argv)
+{
+    sync_buffers();
     return RC_OK;
 }
 
@@ -528,7 +741,7 @@ cmd_mkfs(struct shell *sh, int argc, char **argv)
 		    rc = RC_FAIL;
 		}
 		if(argc > 2)
-		    reserved = kernel->strtoul(argv[2], NULL, 0);
+		    reserved = strtoul(argv[2], NULL, 0);
 		if(!hd->mkfs_partition(p, reserved))
 		    rc = RC_FAIL;
 		kernel->close_module((struct module *)hd);
@@ -545,7 +758,8 @@ struct shell_cmds fs_cmds =
     0,
     { CMD(cp), CMD(type), CMD(ls), CMD(cd), CMD(ln), CMD(mkdir),
       CMD(rm), CMD(rmdir), CMD(mv), CMD(devinfo), CMD(bufstats),
-      CMD(mount), CMD(umount), CMD(mkfs),
+      CMD(bdflush), CMD(sync), CMD(mount), CMD(umount), CMD(mkfs),
+      CMD(prealloc), CMD(clone),
 #ifdef TEST
       CMD(ucp),
 #endif
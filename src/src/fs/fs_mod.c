@@ -12,15 +12,18 @@ struct fs_module fs_module = {
     alloc_device, add_device, remove_device, get_device, release_device,
 
     /* Filesystem functions. */
-    create_file, open_file, close_file, read_file, write_file, seek_file,
-    dup_file, truncate_file, set_file_size, make_link, remove_link,
+    create_file, open_file, close_file, read_file, write_file, read_file_vec,
+    write_file_vec, submit_request, wait_request, cancel_request, seek_file,
+    dup_file, truncate_file, set_file_size, preallocate_file, clone_file, make_link,
+    remove_link,
     set_file_modes, make_directory, remove_directory, get_current_dir,
-    swap_current_dir, make_symlink, mkfs,
+    swap_current_dir, make_symlink, read_dir_plus, mkfs,
 
     /* Buffer-cache functions. */
-    bread, bwrite, bdirty, brelse,
+    bread, bwrite, bdirty, brelse, get_buffer_stats, get_device_stats,
 
     /* Library functions. */
+    open_stream, close_stream, flush_stream, read_stream, write_stream,
     fs_putc, fs_getc, fs_read_line, fs_write_string, fs_fvprintf, fs_fprintf,
 };
 
@@ -41,7 +44,9 @@ fs_init(void)
     init_devices();
     init_buffers();
     init_inodes();
+    init_dcache();
     init_files();
+    init_aio();
     add_fs_commands();
     return TRUE;
 }
@@ -49,6 +54,7 @@ fs_init(void)
 void
 fs_kill(void)
 {
+    kill_aio();
     kill_files();
     kill_inodes();
     kill_buffers();
@@ -8,37 +8,121 @@
 
 #ifndef TEST
 #define kprintf kernel->printf
+#define malloc kernel->malloc
+#define free kernel->free
 #endif
 
 
-/* In-core inode handling. */
+/* In-core inode handling.
 
-static struct core_inode inode_pool[NR_INODES];
+   Every inode in memory is linked into a hash table keyed on its device
+   and i-number. When the last reference to an inode is closed it isn't
+   thrown away but put on an LRU list of unreferenced inodes, so that
+   reopening a recently used file doesn't need to read its inode again.
+   The core_inode structures themselves are allocated from the heap as
+   they're needed; once INODE_CACHE_MAX unreferenced inodes are cached
+   the least recently used of them is reused instead. */
+
+static struct core_inode *inode_hash_table[INODE_HASH_SIZE];
 static struct core_inode *inode_free_list;
-static struct core_inode *inode_open_list;
+static list_t inode_lru;		/* unreferenced, most recent first */
+
+struct inode_stats inode_stats;
+
+#define INODE_HASH(dev, inum) \
+    (((((u_long)(dev)) >> 4) ^ (inum)) & (INODE_HASH_SIZE - 1))
 
 void
 init_inodes(void)
 {
-    int i;
-    for(i = 0; i < (NR_INODES - 1); i++)
-	inode_pool[i].next = &inode_pool[i+1];
-    inode_pool[i].next = 0;
-    inode_free_list = inode_pool;
-    inode_open_list = NULL;
+    memset(inode_hash_table, 0, sizeof(inode_hash_table));
+    inode_free_list = NULL;
+    init_list(&inode_lru);
+    memset(&inode_stats, 0, sizeof(inode_stats));
+}
+
+static void
+unhash_inode(struct core_inode *inode)
+{
+    struct core_inode **x = &inode_hash_table[INODE_HASH(inode->dev,
+							  inode->inum)];
+    while(*x != inode)
+	x = &(*x)->hash_next;
+    *x = inode->hash_next;
+}
+
+/* Put INODE (which mustn't be in the hash table) on the free list. */
+static void
+free_core_inode(struct core_inode *inode)
+{
+    if(inode->dir_index != NULL)
+	free_dir_index(inode);
+    inode->next = inode_free_list;
+    inode_free_list = inode;
+}
+
+/* Throw away the least recently used unreferenced inode. */
+static struct core_inode *
+recycle_inode(void)
+{
+    struct core_inode *inode = (struct core_inode *)inode_lru.tailpred;
+    remove_node(&inode->node);
+    unhash_inode(inode);
+    if(inode->dir_index != NULL)
+	free_dir_index(inode);
+    inode_stats.nr_cached--;
+    inode_stats.recycled++;
+    return inode;
+}
+
+/* Return an unused core_inode structure, or NULL if none can be found.
+   Call with FORBID. */
+static struct core_inode *
+alloc_core_inode(void)
+{
+    struct core_inode *inode = inode_free_list;
+    if(inode != NULL)
+    {
+	inode_free_list = inode->next;
+	return inode;
+    }
+    if(inode_stats.nr_cached < INODE_CACHE_MAX)
+    {
+	inode = malloc(sizeof(struct core_inode));
+	if(inode != NULL)
+	{
+	    memset(inode, 0, sizeof(struct core_inode));
+	    inode_stats.nr_inodes++;
+	    return inode;
+	}
+    }
+    if(!list_empty_p(&inode_lru))
+	return recycle_inode();
+    return NULL;
 }
 
 void
 kill_inodes(void)
 {
     struct core_inode *inode;
+    int i;
     FORBID();
-    inode = inode_open_list;
-    while(inode != NULL)
+    for(i = 0; i < INODE_HASH_SIZE; i++)
     {
-	if(!inode->invalid)
-	    write_inode(inode);
-	inode = inode->next;
+	for(inode = inode_hash_table[i]; inode != NULL;
+	    inode = inode->hash_next)
+	{
+	    if(!inode->invalid)
+		write_inode(inode);
+	}
+    }
+    while(!list_empty_p(&inode_lru))
+	free_core_inode(recycle_inode());
+    while((inode = inode_free_list) != NULL)
+    {
+	inode_free_list = inode->next;
+	free(inode);
+	inode_stats.nr_inodes--;
     }
     PERMIT();
 }
@@ -49,12 +133,12 @@ struct core_inode *
 make_inode(struct fs_device *dev, u_long inum)
 {
     struct core_inode *inode;
-    DB(("make_inode: dev=%s inum=%d inode=%p\n", dev->name, inum, inode));
+    DB(("make_inode: dev=%s inum=%d\n", dev->name, inum));
     if(!test_media(dev))
 	return NULL;
     FORBID();
 again:
-    inode = inode_open_list;
+    inode = inode_hash_table[INODE_HASH(dev, inum)];
     while(inode != NULL)
     {
 	if((inode->inum == inum) && (inode->dev == dev))
@@ -68,7 +152,14 @@ again:
 		    goto again;
 		}
 #endif
-		inode->use_count++;
+		if(inode->use_count++ == 0)
+		{
+		    /* Take it back off the LRU list. */
+		    remove_node(&inode->node);
+		    inode_stats.nr_cached--;
+		    dev->use_count++;
+		}
+		inode_stats.hits++;
 		PERMIT();
 		DB(("make_inode: got cached inode, %p\n", inode));
 		return inode;
@@ -77,24 +168,26 @@ again:
 	       there may be a valid one further down the list, otherwise
 	       we'll just create a fresh one. */
 	}
-	inode = inode->next;
+	inode = inode->hash_next;
     }
-    inode = inode_free_list;
+    inode_stats.misses++;
+    inode = alloc_core_inode();
     if(inode == NULL)
     {
 	ERRNO = E_NOMEM;
 	PERMIT();
 	return NULL;
     }
-    DB(("make_inode: got inode from free_list, %p free_list=%p", inode,
-	inode_free_list));
-    inode_free_list = inode->next;
-    inode->next = inode_open_list;
-    inode_open_list = inode;
+    DB(("make_inode: got new inode, %p\n", inode));
     inode->use_count = 1;
     inode->dev = dev;
     inode->inum = inum;
     inode->invalid = FALSE;
+    inode->dir_index = NULL;
+    clear_bmap_cache(inode);
+    inode->prealloc_count = 0;
+    inode->hash_next = inode_hash_table[INODE_HASH(dev, inum)];
+    inode_hash_table[INODE_HASH(dev, inum)] = inode;
     dev->use_count++;
 #ifndef TEST
     inode->locked = TRUE;
@@ -102,9 +195,8 @@ again:
     if(!read_inode(inode))
     {
 	DB(("make_inode: couldn't read_inode()\n"));
-	inode_open_list = inode->next;
-	inode->next = inode_free_list;
-	inode_free_list = inode;
+	unhash_inode(inode);
+	free_core_inode(inode);
 	release_device(dev);
 #ifndef TEST
 	kernel->wake_up_task_list(&inode->locked_tasks);
@@ -135,7 +227,8 @@ dup_inode(struct core_inode *inode)
 
 /* Say that one person has finished with INODE. It's contents will be
    written to disk if modified and if no other references to INODE
-   exist it will be freed. */
+   exist it will be moved to the LRU list of unreferenced inodes (or
+   freed if it's no longer valid). */
 void
 close_inode(struct core_inode *inode)
 {
@@ -145,53 +238,74 @@ close_inode(struct core_inode *inode)
 	write_inode(inode);
     if(--inode->use_count == 0)
     {
-	struct core_inode **x;
-	FORBID();
-	x = &inode_open_list;
-	while(*x != inode)
-	    x = &(*x)->next;
-	*x = (*x)->next;
-	PERMIT();
+	struct fs_device *dev = inode->dev;
+	if(!inode->invalid)
+	    release_blocks(inode);
+	if(inode->invalid || (inode->inode.nlinks == 0))
+	{
+	    FORBID();
+	    unhash_inode(inode);
+	    PERMIT();
 
-	/* Only deallocate the inode on disk when no one has it open. */
-	if(!inode->invalid && inode->inode.nlinks == 0)
+	    /* Only deallocate the inode on disk when no one has it open. */
+	    if(!inode->invalid && inode->inode.nlinks == 0)
+	    {
+		delete_inode_data(inode);
+		free_inode(inode->dev, inode->inum);
+	    }
+
+	    FORBID();
+	    free_core_inode(inode);
+	    PERMIT();
+	}
+	else
 	{
-	    delete_inode_data(inode);
-	    free_inode(inode->dev, inode->inum);
+	    FORBID();
+	    prepend_node(&inode_lru, &inode->node);
+	    if(++inode_stats.nr_cached > INODE_CACHE_MAX)
+		free_core_inode(recycle_inode());
+	    PERMIT();
 	}
-
-	release_device(inode->dev);
-	FORBID();
-	inode->next = inode_free_list;
-	inode_free_list = inode;
-	PERMIT();
+	release_device(dev);
     }
 }
 
 /* For every inode in memory pointing at device DEV, set its `invalid'
-   flag to TRUE. Returns TRUE if no inodes point at this device, FALSE
-   otherwise. */
+   flag to TRUE, unreferenced inodes are simply discarded. Returns TRUE
+   if no inodes point at this device, FALSE otherwise. */
 bool
 invalidate_device_inodes(struct fs_device *dev)
 {
     bool status = TRUE;
-    struct core_inode *inode;
+    int i;
     FORBID();
-    inode = inode_open_list;
-    while(inode != NULL)
+    for(i = 0; i < INODE_HASH_SIZE; i++)
     {
-	if(inode->dev == dev)
+	struct core_inode **x = &inode_hash_table[i];
+	while(*x != NULL)
 	{
-	    inode->invalid = TRUE;
-	    status = FALSE;
+	    struct core_inode *inode = *x;
+	    if(inode->dev == dev)
+	    {
+		if(inode->use_count == 0)
+		{
+		    *x = inode->hash_next;
+		    remove_node(&inode->node);
+		    inode_stats.nr_cached--;
+		    free_core_inode(inode);
+		    continue;
+		}
+		inode->invalid = TRUE;
+		status = FALSE;
+	    }
+	    x = &inode->hash_next;
 	}
-	inode = inode->next;
     }
     PERMIT();
     return status;
 }
 
-
+
 /* On-disk inode handling. */
 
 /* Return the inode number of a free inode. Or -1 if an error occurred. */
@@ -219,12 +333,13 @@ read_inode(struct core_inode *inode)
 	ERRNO = E_INVALID;
 	return FALSE;
     }
-    buf = bread(inode->dev, ((inode->inum / INODES_PER_BLOCK)
-			     + inode->dev->sup.inodes));
+    buf = bread_class(inode->dev, ((inode->inum / INODES_PER_BLOCK)
+				   + inode->dev->sup.inodes),
+		      BUF_CLASS_INODE);
     if(buf == NULL)
 	return FALSE;
     memcpy(&inode->inode,
-	   &(buf->buf.inodes.inodes[inode->inum % INODES_PER_BLOCK]),
+	   &(buf->buf->inodes.inodes[inode->inum % INODES_PER_BLOCK]),
 	   sizeof(struct inode));
     inode->dirty = FALSE;
     brelse(buf);
@@ -243,21 +358,168 @@ write_inode(struct core_inode *inode)
     }
     if(inode->dirty)
     {
-	struct buf_head *buf = bread(inode->dev,
-				     (inode->inum / INODES_PER_BLOCK)
-				     + inode->dev->sup.inodes);
+	struct buf_head *buf = bread_class(inode->dev,
+					   (inode->inum / INODES_PER_BLOCK)
+					   + inode->dev->sup.inodes,
+					   BUF_CLASS_INODE);
 	if(buf == NULL)
 	    return FALSE;
-	memcpy(&(buf->buf.inodes.inodes[inode->inum % INODES_PER_BLOCK]),
+	memcpy(&(buf->buf->inodes.inodes[inode->inum % INODES_PER_BLOCK]),
 	       &inode->inode,
 	       sizeof(struct inode));
-	bdirty(buf, TRUE);
+	journal_dirty(buf);
 	brelse(buf);
 	inode->dirty = FALSE;
     }
     return TRUE;
 }
 
+/* Copy inode INUM of DEV to INODE without making an in-core inode for
+   it; if it's already in core that copy is used. *BUFP is a buffer held
+   by the caller, if it's the block of the inode table holding INUM it's
+   used, otherwise it's released and replaced by that block. So reading
+   a number of inodes in order of their i-numbers reads each block of the
+   table once. The caller has to brelse() *BUFP when it's finished with
+   it (unless it's NULL). */
+bool
+peek_inode(struct fs_device *dev, u_long inum, struct inode *inode,
+	   struct buf_head **bufp)
+{
+    struct core_inode *ci;
+    blkno blk;
+    FORBID();
+    for(ci = inode_hash_table[INODE_HASH(dev, inum)];
+	ci != NULL; ci = ci->hash_next)
+    {
+	if((ci->inum == inum) && (ci->dev == dev) && !ci->invalid
+#ifndef TEST
+	   && !ci->locked
+#endif
+	   )
+	{
+	    memcpy(inode, &ci->inode, sizeof(struct inode));
+	    PERMIT();
+	    return TRUE;
+	}
+    }
+    PERMIT();
+    if(inum >= dev->sup.num_inodes)
+    {
+	ERRNO = E_BADARG;
+	return FALSE;
+    }
+    blk = (inum / INODES_PER_BLOCK) + dev->sup.inodes;
+    if((*bufp == NULL) || ((*bufp)->blkno != blk))
+    {
+	if(*bufp != NULL)
+	    brelse(*bufp);
+	*bufp = bread_class(dev, blk, BUF_CLASS_INODE);
+	if(*bufp == NULL)
+	    return FALSE;
+    }
+    memcpy(inode, &(*bufp)->buf->inodes.inodes[inum % INODES_PER_BLOCK],
+	   sizeof(struct inode));
+    return TRUE;
+}
+
+/* Block preallocation.
+
+   A file being extended has a run of contiguous blocks reserved for it
+   (marked as used in the bitmap but not yet linked into the file), new
+   blocks are then taken from the run instead of searching the bitmap and
+   writing it once per block. Whatever is left of the run is given back
+   when the last reference to the inode goes, or it's truncated. */
+
+/* Reserve up to COUNT contiguous blocks, near LOCALITY, for INODE. Does
+   nothing if INODE already has some blocks reserved. Returns TRUE if any
+   blocks are now reserved. */
+bool
+reserve_blocks(struct core_inode *inode, blkno locality, u_long count)
+{
+    if(inode->prealloc_count == 0)
+    {
+	blkno blk = alloc_blocks(inode->dev, locality, &count);
+	if(blk == 0)
+	    return FALSE;
+	inode->prealloc_start = blk;
+	inode->prealloc_count = count;
+    }
+    return TRUE;
+}
+
+/* Free any blocks reserved for INODE that haven't been used. */
+void
+release_blocks(struct core_inode *inode)
+{
+    if(inode->prealloc_count > 0)
+    {
+	free_blocks(inode->dev, inode->prealloc_start, inode->prealloc_count);
+	inode->prealloc_count = 0;
+    }
+}
+
+/* Allocate a new block for INODE, from its reserved blocks if it has
+   any, otherwise as near as possible to LOCALITY. */
+static blkno
+alloc_inode_block(struct core_inode *inode, blkno locality)
+{
+    if(inode->prealloc_count > 0)
+    {
+	inode->prealloc_count--;
+	return inode->prealloc_start++;
+    }
+    return alloc_block(inode->dev, locality);
+}
+
+/* INODE is about to write to its block BLK, if that block is shared with
+   other files (see clone_file()) copy it to a new block and drop INODE's
+   reference to it. Returns the block INODE should now use, or zero if an
+   error occurs. */
+static blkno
+unshare_block(struct core_inode *inode, blkno blk)
+{
+    struct buf_head *buf;
+    blkno copy;
+    long refs;
+    if(!(inode->inode.attr & ATTR_CLONED))
+	return blk;
+    refs = block_refs(inode->dev, blk);
+    if(refs <= 0)
+	return (refs < 0) ? 0 : blk;
+    buf = bread(inode->dev, blk);
+    if(buf == NULL)
+	return 0;
+    copy = alloc_block(inode->dev, blk);
+    if(copy != 0)
+    {
+	if(bwrite(inode->dev, copy, buf->buf->data))
+	{
+	    free_block(inode->dev, blk);
+	    inode_stats.cow_copies++;
+	}
+	else
+	{
+	    free_block(inode->dev, copy);
+	    copy = 0;
+	}
+    }
+    brelse(buf);
+    /* Any cached mappings to the shared block are now wrong. */
+    clear_bmap_cache(inode);
+    return copy;
+}
+
+/* Return the number of entries from OFFSET in the array of block numbers
+   PTRS (with LEN elements) that point to consecutive blocks. */
+static inline u_long
+count_run(u_long *ptrs, int offset, int len)
+{
+    u_long run = 1;
+    while((offset + run < len) && (ptrs[offset + run] == ptrs[offset] + run))
+	run++;
+    return run;
+}
+
 static blkno
 get_inode_blkno(struct core_inode *inode, int offset, bool create,
 		bool *created)
@@ -267,8 +529,8 @@ get_inode_blkno(struct core_inode *inode, int offset, bool create,
     {
 	if(create)
 	{
-	    blk = alloc_block(inode->dev,
-			      offset > 0 ? inode->inode.data[offset-1] : 0);
+	    blk = alloc_inode_block(inode,
+				    offset > 0 ? inode->inode.data[offset-1] : 0);
 	    if(blk != 0)
 	    {
 		inode->inode.data[offset] = blk;
@@ -280,8 +542,22 @@ get_inode_blkno(struct core_inode *inode, int offset, bool create,
 	else
 	    ERRNO = E_NOEXIST;
     }
-    else if(created)
-	*created = FALSE;
+    else
+    {
+	if(create)
+	{
+	    blkno copy = unshare_block(inode, blk);
+	    if(copy != blk)
+	    {
+		if(copy == 0)
+		    return 0;
+		inode->inode.data[offset] = blk = copy;
+		inode->dirty = TRUE;
+	    }
+	}
+	if(created)
+	    *created = FALSE;
+    }
     return blk;
 }
 
@@ -293,31 +569,34 @@ get_inode_blk(struct core_inode *inode, int offset, bool create, bool clr)
     blkno blk = get_inode_blkno(inode, offset, create, &created);
     if(blk == 0)
 	return NULL;
-    buf = bread(inode->dev, blk);
+    buf = bread_class(inode->dev, blk, BUF_CLASS_INDIRECT);
     if(buf && clr && created)
     {
-	memset(&buf->buf.data, 0, FS_BLKSIZ);
+	memset(&buf->buf->data, 0, FS_BLKSIZ);
 	bdirty(buf, FALSE);
     }
     return buf;
 }
 
-/* Note that IND-BLK is released in here! */
+/* Note that IND-BLK is released in here! If RUNP is non-NULL the number
+   of consecutive blocks starting at the one returned is stored in it. */
 static blkno
 get_indirect_blkno(struct core_inode *inode, struct buf_head *ind_buf,
-		   int offset, bool create, bool *created)
+		   int offset, bool create, bool *created, u_long *runp)
 {
-    blkno blk = ind_buf->buf.ind.data[offset];
+    blkno blk = ind_buf->buf->ind.data[offset];
     if(blk == 0)
     {
 	if(create)
 	{
-	    blk = alloc_block(inode->dev,
-			      (offset > 0) ? ind_buf->buf.ind.data[offset-1] : 0);
+	    blk = alloc_inode_block(inode,
+				    ((offset > 0)
+				     ? ind_buf->buf->ind.data[offset-1]
+				     : ind_buf->blkno));
 	    if(blk != 0)
 	    {
-		ind_buf->buf.ind.data[offset] = blk;
-		bdirty(ind_buf, TRUE);
+		ind_buf->buf->ind.data[offset] = blk;
+		journal_dirty(ind_buf);
 		if(created)
 		    *created = TRUE;
 	    }
@@ -325,8 +604,26 @@ get_indirect_blkno(struct core_inode *inode, struct buf_head *ind_buf,
 	else
 	    ERRNO = E_NOEXIST;
     }
-    else if(created)
-	*created = FALSE;
+    else
+    {
+	if(create)
+	{
+	    blkno copy = unshare_block(inode, blk);
+	    if(copy != blk)
+	    {
+		if(copy != 0)
+		{
+		    ind_buf->buf->ind.data[offset] = copy;
+		    journal_dirty(ind_buf);
+		}
+		blk = copy;
+	    }
+	}
+	if(created)
+	    *created = FALSE;
+    }
+    if((blk != 0) && (runp != NULL))
+	*runp = count_run(ind_buf->buf->ind.data, offset, PTRS_PER_INDIRECT);
     brelse(ind_buf);
     return blk;
 }
@@ -338,42 +635,95 @@ get_indirect_blk(struct core_inode *inode, struct buf_head *ind_buf,
 {
     struct buf_head *buf;
     bool created;
-    blkno blk = get_indirect_blkno(inode, ind_buf, offset, create, &created);
+    blkno blk = get_indirect_blkno(inode, ind_buf, offset, create, &created,
+				   NULL);
     if(blk == 0)
 	return NULL;
-    buf = bread(inode->dev, blk);
+    buf = bread_class(inode->dev, blk, BUF_CLASS_INDIRECT);
     if(buf && clr && created)
     {
-	memset(&buf->buf.data, 0, FS_BLKSIZ);
+	memset(&buf->buf->data, 0, FS_BLKSIZ);
 	bdirty(buf, FALSE);
     }
     return buf;
 }
 
-/* Returns the data block corresponding to logical block BLK of the file
-   linked to FILE. Or NULL if an error occurs. If CREATE is TRUE the block
-   (and indirect links to it) will be created if they don't already exist.
-   Note that if you call this with CREATE=TRUE be sure to call write_inode()
-   in the near future. */
-blkno
-get_data_blkno(struct core_inode *inode, blkno blk, bool create)
+/* The block map cache.
+
+   Each core_inode remembers a few extents, runs of logical blocks that
+   are stored in consecutive physical blocks, found by its recent
+   get_data_blkno() calls. Whenever the indirect blocks are walked the
+   whole run of consecutive pointers around the block is recorded, so
+   sequential access to a large file only has to read the indirect blocks
+   once per run. Mappings only change when blocks are freed, whoever does
+   that must call clear_bmap_cache(). */
+
+void
+clear_bmap_cache(struct core_inode *inode)
 {
-    struct buf_head *tmp;
-    test_media(inode->dev);
-    if(inode->invalid)
+    memset(inode->bmap_cache, 0, sizeof(inode->bmap_cache));
+    inode->bmap_last = 0;
+}
+
+/* Return the physical block that logical block BLK of INODE is mapped to
+   in its cache, or zero. */
+static inline blkno
+bmap_cache_lookup(struct core_inode *inode, blkno blk)
+{
+    int i = inode->bmap_last;
+    do {
+	struct bmap_extent *x = &inode->bmap_cache[i];
+	if((blk >= x->logical) && (blk < x->logical + x->count))
+	{
+	    inode->bmap_last = i;
+	    return x->physical + (blk - x->logical);
+	}
+	i = (i + 1) % BMAP_CACHE_SIZE;
+    } while(i != inode->bmap_last);
+    return 0;
+}
+
+/* Record that the COUNT logical blocks from BLK of INODE are stored
+   from the physical block PHYS. */
+static void
+bmap_cache_enter(struct core_inode *inode, blkno blk, blkno phys,
+		 u_long count)
+{
+    struct bmap_extent *x = &inode->bmap_cache[inode->bmap_last];
+    if((x->count != 0) && (blk == x->logical + x->count)
+       && (phys == x->physical + x->count))
     {
-	ERRNO = E_INVALID;
-	return 0;
+	/* Carries on from the last extent used. */
+	x->count += count;
+	return;
     }
+    inode->bmap_last = (inode->bmap_last + 1) % BMAP_CACHE_SIZE;
+    x = &inode->bmap_cache[inode->bmap_last];
+    x->logical = blk;
+    x->physical = phys;
+    x->count = count;
+}
+
+/* Find the physical block of logical block BLK of INODE by walking its
+   block pointers, storing the length of the run it starts in *RUNP. */
+static blkno
+map_block(struct core_inode *inode, blkno blk, bool create, u_long *runp)
+{
+    struct buf_head *tmp;
     if(blk < SINGLE_INDIRECT)
-	return get_inode_blkno(inode, blk, create, NULL);
+    {
+	blkno phys = get_inode_blkno(inode, blk, create, NULL);
+	if(phys != 0)
+	    *runp = count_run(inode->inode.data, blk, SINGLE_INDIRECT);
+	return phys;
+    }
     blk -= SINGLE_INDIRECT;
     if(blk < PTRS_PER_INDIRECT)
     {
 	tmp = get_inode_blk(inode, SINGLE_INDIRECT, create, TRUE);
 	if(tmp == NULL)
 	    return 0;
-	return get_indirect_blkno(inode, tmp, blk, create, NULL);
+	return get_indirect_blkno(inode, tmp, blk, create, NULL, runp);
     }
     blk -= PTRS_PER_INDIRECT;
     if(blk < (PTRS_PER_INDIRECT * PTRS_PER_INDIRECT))
@@ -386,7 +736,7 @@ get_data_blkno(struct core_inode *inode, blkno blk, bool create)
 	if(tmp == NULL)
 	    return 0;
 	return get_indirect_blkno(inode, tmp, blk % PTRS_PER_INDIRECT,
-				  create, NULL);
+				  create, NULL, runp);
     }
     blk -= PTRS_PER_INDIRECT * PTRS_PER_INDIRECT;
     if(blk < (PTRS_PER_INDIRECT * PTRS_PER_INDIRECT * PTRS_PER_INDIRECT))
@@ -405,13 +755,51 @@ get_data_blkno(struct core_inode *inode, blkno blk, bool create)
 	if(tmp == NULL)
 	    return 0;
 	return get_indirect_blkno(inode, tmp, blk % PTRS_PER_INDIRECT,
-				  create, NULL);
+				  create, NULL, runp);
     }
     ERRNO = E_BADARG;
     return 0;
 }
 
 
+
+/* Returns the data block corresponding to logical block BLK of the file
+   linked to FILE. Or NULL if an error occurs. If CREATE is TRUE the block
+   (and indirect links to it) will be created if they don't already exist.
+   Note that if you call this with CREATE=TRUE be sure to call write_inode()
+   in the near future. */
+blkno
+get_data_blkno(struct core_inode *inode, blkno blk, bool create)
+{
+    blkno phys;
+    u_long run;
+    test_media(inode->dev);
+    if(inode->invalid)
+    {
+	ERRNO = E_INVALID;
+	return 0;
+    }
+    if(inode->inode.attr & ATTR_INLINE)
+    {
+	/* The block pointers hold the file's data. */
+	ERRNO = E_BADARG;
+	return 0;
+    }
+    /* Writes to a clone have to check whether the block is shared. */
+    phys = ((create && (inode->inode.attr & ATTR_CLONED))
+	    ? 0 : bmap_cache_lookup(inode, blk));
+    if(phys != 0)
+    {
+	inode_stats.bmap_hits++;
+	return phys;
+    }
+    inode_stats.bmap_misses++;
+    phys = map_block(inode, blk, create, &run);
+    if(phys != 0)
+	bmap_cache_enter(inode, blk, phys, run);
+    return phys;
+}
+
 /* Returns the data block corresponding to logical block BLK of the file
    linked to FILE. Or NULL if an error occurs. If CREATE is TRUE the block
    (and indirect links to it) will be created if they don't already exist.
@@ -422,7 +810,11 @@ get_data_block(struct core_inode *inode, blkno blk, bool create)
 {
     blk = get_data_blkno(inode, blk, create);
     if(blk != 0)
-	return bread(inode->dev, blk);
+    {
+	return bread_class(inode->dev, blk,
+			   ((inode->inode.attr & ATTR_DIRECTORY)
+			    ? BUF_CLASS_DIR : BUF_CLASS_DATA));
+    }
     else
 	return NULL;
 }
@@ -0,0 +1,407 @@
+/* journal.c -- Metadata log.
+
+   A device made by mkfs has a log of a few blocks between its data bitmap
+   and its data blocks (described by the `struct super_ext' in the boot
+   block). Instead of marking a changed bitmap, inode, indirect or
+   directory block to be written at bdflush's next pass, the file system
+   calls journal_dirty() to add its buffer to the device's open
+   transaction. The buffer is held until the transaction is committed so
+   that it can't be written to its home location early.
+
+   Committing a transaction writes copies of all its blocks to the log in
+   a single request, then the log header recording where each block
+   belongs (this is the commit record). The buffers are then released as
+   ordinary dirty buffers for bdflush to write back. The copies are kept
+   in memory until the next commit, which first writes any of them whose
+   buffers haven't been written back yet (the checkpoint) so that the log
+   can be reused.
+
+   When a device with a log is read, a valid transaction left in the log
+   is copied to the home locations of its blocks before anything else is
+   done, so that a crash never leaves half of a group of related changes
+   on the disk. */
+
+#include <vmm/fs.h>
+#include <vmm/errno.h>
+#include <vmm/string.h>
+#include <vmm/kernel.h>
+#ifndef TEST
+# define kprintf kernel->printf
+# define malloc kernel->malloc
+# define free kernel->free
+#endif
+
+/* Returns the checksum of the sequence number and block numbers in HDR
+   and the HDR->nr_blocks blocks at DATA. */
+static u_long
+log_checksum(struct log_header *hdr, const u_char *data)
+{
+    const u_long *p = (const u_long *)data;
+    u_long sum = hdr->sequence;
+    u_long i;
+    for(i = 0; i < hdr->nr_blocks; i++)
+	sum = ((sum << 1) | (sum >> 31)) + hdr->home[i];
+    for(i = 0; i < hdr->nr_blocks * (FS_BLKSIZ / sizeof(u_long)); i++)
+	sum = ((sum << 1) | (sum >> 31)) + p[i];
+    return sum;
+}
+
+/* Write the COUNT blocks at DATA to the blocks of DEV listed in HOME,
+   using one request for each run of consecutive block numbers. If
+   DIRTY-ONLY is TRUE blocks whose cached buffers have been written back
+   since they were last changed are skipped. */
+static bool
+write_home(struct fs_device *dev, const blkno *home, const u_char *data,
+	   u_long count, bool dirty_only)
+{
+    u_long i = 0;
+    while(i < count)
+    {
+	u_long n = 1;
+	if(dirty_only && !bdirty_p(dev, home[i]))
+	{
+	    i++;
+	    continue;
+	}
+	while((i + n < count) && (home[i + n] == home[i] + n)
+	      && (!dirty_only || bdirty_p(dev, home[i + n])))
+	    n++;
+	ERRNO = FS_WRITE_BLOCKS(dev, home[i], (void *)(data + i * FS_BLKSIZ), n);
+	if(ERRNO < 0)
+	    return FALSE;
+	i += n;
+    }
+    return TRUE;
+}
+
+/* Write J's header to DEV saying that the log is empty. */
+static bool
+clear_log(struct fs_device *dev, struct journal *j)
+{
+    memset(j->header, 0, FS_BLKSIZ);
+    j->header->magic = FS_LOG_MAGIC;
+    j->header->sequence = j->sequence;
+    ERRNO = FS_WRITE_BLOCKS(dev, j->start, j->header, 1);
+    return ERRNO >= 0;
+}
+
+/* Make sure every block of J's last committed transaction has reached
+   its home location, after this the log may be overwritten. */
+static bool
+checkpoint(struct fs_device *dev, struct journal *j)
+{
+    if(j->nr_done > 0)
+    {
+	if(!write_home(dev, j->done, j->image, j->nr_done, TRUE))
+	    return FALSE;
+	j->nr_done = 0;
+    }
+    return TRUE;
+}
+
+/* If the log of DEV holds a committed transaction copy its blocks to
+   their home locations and mark the log as empty. */
+static bool
+replay_log(struct fs_device *dev, struct journal *j)
+{
+    struct log_header *hdr = j->header;
+    u_long i;
+    ERRNO = FS_READ_BLOCKS(dev, j->start, hdr, 1);
+    if(ERRNO < 0)
+	return FALSE;
+    if(hdr->magic != FS_LOG_MAGIC)
+	return clear_log(dev, j);
+    j->sequence = hdr->sequence;
+    if((hdr->nr_blocks == 0) || (hdr->nr_blocks > j->max_blocks))
+	return TRUE;
+    for(i = 0; i < hdr->nr_blocks; i++)
+    {
+	if((hdr->home[i] <= BOOT_BLK)
+	   || (hdr->home[i] >= dev->sup.total_blocks))
+	    return clear_log(dev, j);
+    }
+    ERRNO = FS_READ_BLOCKS(dev, j->start + 1, j->image, hdr->nr_blocks);
+    if(ERRNO < 0)
+	return FALSE;
+    /* If the checksum is wrong the crash happened while the transaction
+       was being written, none of it reached its home locations. */
+    if(log_checksum(hdr, j->image) == hdr->checksum)
+    {
+	kprintf("fs: Replaying %d logged blocks on device `%s'\n",
+		hdr->nr_blocks, dev->name);
+	if(!write_home(dev, hdr->home, j->image, hdr->nr_blocks, FALSE))
+	    return FALSE;
+    }
+    return clear_log(dev, j);
+}
+
+/* Called after the boot block BB of DEV has been read. If the device has
+   a metadata log this sets up DEV->journal, replaying the log first if
+   necessary. Returns FALSE if the log couldn't be read. */
+bool
+open_journal(struct fs_device *dev, struct boot_blk *bb)
+{
+    struct journal *j;
+    free_journal(dev);
+    if((bb->ext.magic != FS_EXT_MAGIC) || (bb->ext.log_size < 2))
+	return TRUE;
+    j = malloc(sizeof(struct journal));
+    if(j == NULL)
+    {
+	ERRNO = E_NOMEM;
+	return FALSE;
+    }
+    j->start = bb->ext.log_start;
+    j->max_blocks = min(bb->ext.log_size - 1, JOURNAL_MAX_BLOCKS);
+    j->sequence = 0;
+    j->nr_open = j->nr_done = 0;
+    j->image = malloc(j->max_blocks * FS_BLKSIZ);
+    j->header = malloc(FS_BLKSIZ);
+    if((j->image == NULL) || (j->header == NULL))
+    {
+	if(j->image != NULL)
+	    free(j->image);
+	if(j->header != NULL)
+	    free(j->header);
+	free(j);
+	ERRNO = E_NOMEM;
+	return FALSE;
+    }
+#ifndef TEST
+    set_sem_clear(&j->lock);
+#endif
+    dev->journal = j;
+    if(!replay_log(dev, j))
+    {
+	kprintf("fs: Can't replay the log of device `%s'\n", dev->name);
+	free_journal(dev);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Discard DEV's journal without writing anything, any transaction still
+   open is lost. */
+void
+free_journal(struct fs_device *dev)
+{
+    struct journal *j = dev->journal;
+    if(j != NULL)
+    {
+	u_long i;
+	dev->journal = NULL;
+	for(i = 0; i < j->nr_open; i++)
+	{
+	    j->open[i]->transactions--;
+	    brelse(j->open[i]);
+	}
+	free(j->image);
+	free(j->header);
+	free(j);
+    }
+}
+
+/* Commit DEV's open transaction and write everything in the log to its
+   home location, leaving the log empty. This is called before a device
+   is discarded. */
+bool
+close_journal(struct fs_device *dev)
+{
+    struct journal *j = dev->journal;
+    bool rc;
+    if(j == NULL)
+	return TRUE;
+    rc = commit_journal(dev);
+#ifndef TEST
+    wait(&j->lock);
+#endif
+    rc = rc && checkpoint(dev, j) && clear_log(dev, j);
+#ifndef TEST
+    signal(&j->lock);
+#endif
+    return rc;
+}
+
+/* Commit the open transaction of DEV to its log. If the log can't be
+   written the transaction's blocks are written in place as before. This
+   MAY sleep. */
+bool
+commit_journal(struct fs_device *dev)
+{
+    struct journal *j = dev->journal;
+    struct buf_head *bufs[JOURNAL_MAX_BLOCKS];
+    u_long i, n;
+    bool rc;
+    if((j == NULL) || (j->nr_open == 0))
+	return TRUE;
+#ifndef TEST
+    wait(&j->lock);
+#endif
+    rc = checkpoint(dev, j);
+    /* Take the transaction over, anything changed while it's being
+       written goes into the next one. */
+    FORBID();
+    n = j->nr_open;
+    for(i = 0; i < n; i++)
+    {
+	bufs[i] = j->open[i];
+	j->done[i] = bufs[i]->blkno;
+	memcpy(j->image + i * FS_BLKSIZ, bufs[i]->buf->data, FS_BLKSIZ);
+    }
+    j->nr_open = 0;
+    PERMIT();
+    if(rc && (n > 0))
+    {
+	struct log_header *hdr = j->header;
+	memset(hdr, 0, FS_BLKSIZ);
+	hdr->magic = FS_LOG_MAGIC;
+	hdr->sequence = j->sequence + 1;
+	hdr->nr_blocks = n;
+	memcpy(hdr->home, j->done, n * sizeof(blkno));
+	hdr->checksum = log_checksum(hdr, j->image);
+	ERRNO = FS_WRITE_BLOCKS(dev, j->start + 1, j->image, n);
+	if(ERRNO >= 0)
+	    ERRNO = FS_WRITE_BLOCKS(dev, j->start, hdr, 1);
+	rc = ERRNO >= 0;
+    }
+    if(rc)
+    {
+	j->sequence++;
+	j->nr_done = n;
+    }
+    else
+    {
+	kprintf("fs: Can't write the log of device `%s'\n", dev->name);
+	j->nr_done = 0;
+    }
+    for(i = 0; i < n; i++)
+    {
+	/* Only now may the buffer be written in place. */
+	bufs[i]->transactions--;
+	bdirty(bufs[i], !rc);
+	brelse(bufs[i]);
+    }
+#ifndef TEST
+    signal(&j->lock);
+#endif
+    return rc;
+}
+
+/* Commit the open transactions of all devices. Called by each pass of
+   bdflush. */
+void
+commit_journals(void)
+{
+    struct fs_device *dev;
+    FORBID();
+    dev = device_list;
+    while(dev != NULL)
+    {
+	struct fs_device *next;
+	if(!dev->invalid && (dev->journal != NULL)
+	   && (dev->journal->nr_open > 0))
+	{
+	    dev->use_count++;
+	    PERMIT();
+	    commit_journal(dev);
+	    FORBID();
+	    next = dev->next;
+	    release_device(dev);
+	}
+	else
+	    next = dev->next;
+	dev = next;
+    }
+    PERMIT();
+}
+
+/* Mark that the metadata block in the buffer BH has been changed. This
+   should be used instead of bdirty() for blocks whose contents have to
+   stay consistent with each other; the buffer is added to the open
+   transaction of its device and held until it's committed. Devices
+   without a log just have the buffer written at bdflush's next pass. */
+void
+journal_dirty(struct buf_head *bh)
+{
+    struct journal *j = bh->dev->journal;
+    u_long i;
+    if((j == NULL) || bh->invalid)
+    {
+	bdirty(bh, TRUE);
+	return;
+    }
+    FORBID();
+    for(i = 0; (i < j->nr_open) && (j->open[i]->blkno < bh->blkno); i++)
+	;
+    if((i < j->nr_open) && (j->open[i] == bh))
+    {
+	PERMIT();
+	return;
+    }
+    if(j->nr_open == j->max_blocks)
+    {
+	/* This transaction is full. The caller holds BH so it can't be
+	   written until it's been added to the next one. */
+	PERMIT();
+	commit_journal(bh->dev);
+	journal_dirty(bh);
+	return;
+    }
+    memmove(&j->open[i + 1], &j->open[i],
+	    (j->nr_open - i) * sizeof(struct buf_head *));
+    j->open[i] = bh;
+    j->nr_open++;
+    bh->use_count++;
+    bh->transactions++;
+    PERMIT();
+}
+
+/* The COUNT blocks of DEV starting at BLK are being freed. Any of them
+   in the open transaction are dropped from it, and if any are in the log
+   the log is emptied so that replaying it can't overwrite the blocks
+   after they've been allocated again. */
+void
+journal_forget(struct fs_device *dev, blkno blk, u_long count)
+{
+    struct journal *j = dev->journal;
+    u_long i;
+    bool logged = FALSE;
+    if(j == NULL)
+	return;
+    FORBID();
+    i = 0;
+    while(i < j->nr_open)
+    {
+	struct buf_head *bh = j->open[i];
+	if((bh->blkno >= blk) && (bh->blkno < blk + count))
+	{
+	    j->nr_open--;
+	    memmove(&j->open[i], &j->open[i + 1],
+		    (j->nr_open - i) * sizeof(struct buf_head *));
+	    bh->transactions--;
+	    brelse(bh);
+	}
+	else
+	    i++;
+    }
+    for(i = 0; i < j->nr_done; i++)
+    {
+	if((j->done[i] >= blk) && (j->done[i] < blk + count))
+	{
+	    logged = TRUE;
+	    break;
+	}
+    }
+    PERMIT();
+    if(logged)
+    {
+#ifndef TEST
+	wait(&j->lock);
+#endif
+	if(!checkpoint(dev, j) || !clear_log(dev, j))
+	    kprintf("fs: Can't write the log of device `%s'\n", dev->name);
+#ifndef TEST
+	signal(&j->lock);
+#endif
+    }
+}
@@ -10,31 +10,214 @@
 #ifndef TEST
 # define kprintf kernel->printf
 # define kvsprintf kernel->vsprintf
+# define malloc kernel->malloc
+# define free kernel->free
 #endif
 
-/* Really need buffered I/O for this type of thing :-(  */
+/* Buffered streams.
 
-inline int
-fs_putc(u_char c, struct file *fh)
+   A stream wraps a file handle with a buffer so that reading or writing
+   a character at a time doesn't cost a call to read_file() or
+   write_file() each. The buffer either holds data read ahead from the
+   file (the file's position is then at the end of the buffered data) or
+   data written to the stream but not yet to the file, never both.
+   Switching from one to the other flushes or discards the buffer. */
+
+/* Create a stream on the file handle FILE, with a buffer of BUFSIZ bytes
+   (or FS_STREAM_BUFSIZ if BUFSIZ is zero). The stream doesn't own FILE,
+   it must be closed separately after the stream. Returns a null pointer
+   if no memory is available. */
+struct fs_stream *
+open_stream(struct file *file, size_t bufsiz)
 {
-    return write_file(&c, 1, fh);
+    struct fs_stream *s;
+    if(file == NULL)
+    {
+	ERRNO = E_BADARG;
+	return NULL;
+    }
+    if(bufsiz == 0)
+	bufsiz = FS_STREAM_BUFSIZ;
+    s = malloc(sizeof(struct fs_stream) + bufsiz);
+    if(s == NULL)
+    {
+	ERRNO = E_NOMEM;
+	return NULL;
+    }
+    s->file = file;
+    s->buf = (u_char *)(s + 1);
+    s->size = bufsiz;
+    s->pos = s->len = 0;
+    s->writing = FALSE;
+    return s;
 }
 
-inline int
-fs_getc(struct file *fh)
+/* Write any buffered output of stream S to its file, or if S holds
+   read-ahead data discard it (moving the file back to the position of
+   the stream). Returns FALSE if an error occurs. */
+bool
+flush_stream(struct fs_stream *s)
 {
-    u_char c;
-    int val = read_file(&c, 1, fh);
-    return val != 1 ? ((val == 0) ? EOF : val) : (int)c;
+    if(s->writing)
+    {
+	size_t done = 0;
+	while(done < s->pos)
+	{
+	    long actual = write_file(s->buf + done, s->pos - done, s->file);
+	    if(actual <= 0)
+	    {
+		/* Keep what couldn't be written. */
+		memmove(s->buf, s->buf + done, s->pos - done);
+		s->pos -= done;
+		return FALSE;
+	    }
+	    done += actual;
+	}
+	s->writing = FALSE;
+    }
+    else if(s->pos < s->len)
+    {
+	if(seek_file(s->file, -(long)(s->len - s->pos), SEEK_REL) < 0)
+	    return FALSE;
+    }
+    s->pos = s->len = 0;
+    return TRUE;
+}
+
+/* Flush the stream S then free it; its file is left open. Returns FALSE
+   if the flush failed. */
+bool
+close_stream(struct fs_stream *s)
+{
+    bool rc = flush_stream(s);
+    free(s);
+    return rc;
+}
+
+/* Refill the read buffer of S, returns the number of bytes now buffered,
+   zero at the end of the file or a negative error code. */
+static long
+fill_stream(struct fs_stream *s)
+{
+    long actual;
+    if(s->writing && !flush_stream(s))
+	return -ERRNO;
+    actual = read_file(s->buf, s->size, s->file);
+    s->pos = 0;
+    s->len = (actual > 0) ? actual : 0;
+    return actual;
+}
+
+/* Read up to LEN bytes from stream S into BUF. Returns the number of
+   bytes read (zero at the end of the file) or a negative error code. */
+long
+read_stream(void *buf, size_t len, struct fs_stream *s)
+{
+    size_t done = 0;
+    if(s->writing && !flush_stream(s))
+	return -ERRNO;
+    while(done < len)
+    {
+	size_t avail = s->len - s->pos;
+	if(avail == 0)
+	{
+	    long actual;
+	    if((len - done) >= s->size)
+	    {
+		/* Big reads go straight to the file. */
+		actual = read_file((char *)buf + done, len - done, s->file);
+		if(actual > 0)
+		    done += actual;
+	    }
+	    else
+	    {
+		actual = fill_stream(s);
+		if(actual > 0)
+		    continue;
+	    }
+	    if(actual < 0)
+		return (done > 0) ? done : actual;
+	    break;
+	}
+	if(avail > (len - done))
+	    avail = len - done;
+	memcpy((char *)buf + done, s->buf + s->pos, avail);
+	s->pos += avail;
+	done += avail;
+    }
+    return done;
+}
+
+/* Write LEN bytes from BUF to stream S. Returns the number of bytes
+   written or a negative error code. */
+long
+write_stream(const void *buf, size_t len, struct fs_stream *s)
+{
+    size_t done = 0;
+    if(!s->writing)
+    {
+	if(!flush_stream(s))
+	    return -ERRNO;
+	s->writing = TRUE;
+    }
+    while(done < len)
+    {
+	size_t room = s->size - s->pos;
+	if(room == 0)
+	{
+	    if(!flush_stream(s))
+		return (done > 0) ? done : -ERRNO;
+	    s->writing = TRUE;
+	    room = s->size;
+	}
+	if((s->pos == 0) && ((len - done) >= s->size))
+	{
+	    /* Nothing buffered and more than a buffer-full to write. */
+	    long actual = write_file((const char *)buf + done,
+				     len - done, s->file);
+	    if(actual < 0)
+		return (done > 0) ? done : actual;
+	    return done + actual;
+	}
+	if(room > (len - done))
+	    room = len - done;
+	memcpy(s->buf + s->pos, (const char *)buf + done, room);
+	s->pos += room;
+	done += room;
+    }
+    return done;
+}
+
+int
+fs_putc(u_char c, struct fs_stream *s)
+{
+    if(s->writing && (s->pos < s->size))
+    {
+	s->buf[s->pos++] = c;
+	return 1;
+    }
+    return write_stream(&c, 1, s);
+}
+
+int
+fs_getc(struct fs_stream *s)
+{
+    if(s->pos >= s->len || s->writing)
+    {
+	long actual = fill_stream(s);
+	if(actual <= 0)
+	    return (actual == 0) ? EOF : actual;
+    }
+    return s->buf[s->pos++];
 }
 
 char *
-fs_read_line(char *buf, size_t bufsiz, struct file *fh)
+fs_read_line(char *buf, size_t bufsiz, struct fs_stream *s)
 {
     char *ptr = buf;
     while(--bufsiz != 0)
     {
-	int c = fs_getc(fh);
+	int c = fs_getc(s);
 	if(c < 0)
 	    break;
 	*ptr++ = c;
@@ -45,27 +228,27 @@ fs_read_line(char *buf, size_t bufsiz, struct file *fh)
     return (ptr == buf) ? NULL : buf;
 }
 
-inline int
-fs_write_string(const char *str, struct file *fh)
+int
+fs_write_string(const char *str, struct fs_stream *s)
 {
-    return write_file(str, strlen(str), fh);
+    return write_stream(str, strlen(str), s);
 }
 
 int
-fs_fvprintf(struct file *fh, const char *fmt, va_list args)
+fs_fvprintf(struct fs_stream *s, const char *fmt, va_list args)
 {
     char buf[512];
     kvsprintf(buf, fmt, args);
-    return fs_write_string(buf, fh);
+    return fs_write_string(buf, s);
 }
 
 int
-fs_fprintf(struct file *fh, const char *fmt, ...)
+fs_fprintf(struct fs_stream *s, const char *fmt, ...)
 {
     int ret;
     va_list args;
     va_start(args, fmt);
-    ret = fs_fvprintf(fh, fmt, args);
+    ret = fs_fvprintf(s, fmt, args);
     va_end(args);
     return ret;
 }
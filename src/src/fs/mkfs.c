@@ -28,7 +28,9 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 {
     int tmp;
     blkno block;
-    blk tmp_blk;
+    u_long log_size, refs;
+    blkno refcount_start;
+    static blk tmp_blk;			/* could be a page, keep it off the stack */
 #define TMP_INODE_BLK ((struct inode_blk *)&tmp_blk)
 #define TMP_DIR_BLK ((struct dir_entry_blk *)&tmp_blk)
 #define TMP_BMAP_BLK ((u_long *)&tmp_blk)
@@ -37,6 +39,9 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
     /* First calculate the dimensions of each area of the disk. */
     struct super_data sup;
     sup.total_blocks = blocks;
+    log_size = min(FS_LOG_SIZE, blocks / 32);
+    if(log_size < FS_LOG_MIN)
+	log_size = 0;
     blocks--;				/* boot block */
     blocks -= reserved;
     sup.inode_bitmap = 1 + reserved;
@@ -45,10 +50,13 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
     blocks -= (((sup.num_inodes / (FS_BLKSIZ * 8)) + 1)
 	       + (sup.num_inodes / INODES_PER_BLOCK));
     sup.data_bitmap = sup.inodes + (sup.num_inodes / INODES_PER_BLOCK);
+    blocks -= log_size;			/* metadata log */
     tmp = (blocks / (FS_BLKSIZ * 8)) + 1;
-    blocks -= tmp;
+    refs = (blocks / FS_BLKSIZ) + 1;	/* a byte per data block */
+    blocks -= tmp + refs;
     sup.data_size = blocks;
-    sup.data = sup.data_bitmap + tmp;
+    refcount_start = sup.data_bitmap + tmp;
+    sup.data = refcount_start + refs + log_size;
 
     /* Now write the stuff out. */
 
@@ -125,7 +133,7 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 	block++;
     }
 
-    if(block != sup.data)
+    if(block != refcount_start)
     {
 	if(block == sup.data_bitmap)
 	    set_bit(TMP_BMAP_BLK, 0);
@@ -140,6 +148,27 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 	block++;
     }
 
+    /* No blocks are shared yet. */
+    memset(&tmp_blk, 0, FS_BLKSIZ);
+    while(block < refcount_start + refs)
+    {
+	ERRNO = FS_WRITE_BLOCKS(dev, block, &tmp_blk, 1);
+	if(ERRNO < 0)
+	    return FALSE;
+	block++;
+    }
+
+    /* An empty log, only its header needs to be written. */
+    if(log_size > 0)
+    {
+	struct log_header *hdr = (struct log_header *)&tmp_blk;
+	memset(hdr, 0, FS_BLKSIZ);
+	hdr->magic = FS_LOG_MAGIC;
+	ERRNO = FS_WRITE_BLOCKS(dev, sup.data - log_size, hdr, 1);
+	if(ERRNO < 0)
+	    return FALSE;
+    }
+
     /* Dir entries for the root. Using the first data block as the
        root dir's first directory entry block. */
     memset(TMP_DIR_BLK, 0, FS_BLKSIZ);
@@ -156,6 +185,13 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 	return FALSE;
     memcpy(&TMP_BOOT_BLK->sup, &sup, sizeof(sup));
     TMP_BOOT_BLK->magic = FS_BOOT_MAGIC;
+    TMP_BOOT_BLK->ext.magic = FS_EXT_MAGIC;
+    TMP_BOOT_BLK->ext.log_start = sup.data - log_size;
+    TMP_BOOT_BLK->ext.log_size = log_size;
+    TMP_BOOT_BLK->ext.block_size = FS_BLKSIZ;
+    TMP_BOOT_BLK->ext.features = FS_FEAT_INLINE | FS_FEAT_REFCOUNT;
+    TMP_BOOT_BLK->ext.refcount_start = refcount_start;
+    TMP_BOOT_BLK->ext.refcount_size = refs;
     memcpy(&TMP_BOOT_BLK->boot_code, bootsect_code,
         sizeof(TMP_BOOT_BLK->boot_code)); 
     ERRNO = FS_WRITE_BLOCKS(dev, BOOT_BLK, TMP_BOOT_BLK, 1);
@@ -0,0 +1,339 @@
+/* bench.c -- File system benchmarks for the test harness.
+
+   The `bench' command runs a fixed set of workloads in a scratch
+   directory of the test device and prints the rate of each along with
+   the buffer cache and inode cache hit rates and the number of device
+   requests it made. Each workload starts with the buffer cache written
+   back and emptied, and the random workloads use their own generator
+   with a fixed seed, so two runs over the same image do the same I/O.
+   Wall-clock rates vary with the host of course; with the `latency'
+   command they're dominated by the simulated disk instead.
+
+   Use `make bench' (or `make bench-ide') for a run on a new image. */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define __NO_TYPE_CLASHES
+#include <vmm/fs.h>
+#include <vmm/errno.h>
+#include <vmm/shell.h>
+
+#define BENCH_DIR "bench.tmp"
+
+/* Sizes of the workloads at scale 1. */
+#define BENCH_FILES	256		/* files created, looked up, deleted */
+#define BENCH_LOOKUPS	4		/* lookups of each file */
+#define BENCH_LISTS	8		/* listings of the directory */
+#define BENCH_SEQ_SIZE	(4 * 1024 * 1024)
+#define BENCH_SEQ_CHUNK	16384
+#define BENCH_RAND_OPS	1024
+#define BENCH_RAND_SIZE	4096
+
+/* The counters which are compared before and after each workload. */
+struct bench_counts {
+    struct timeval time;
+    struct buffer_stats buf;
+    struct inode_stats inodes;
+    struct fs_dev_stats dev;
+    u_long delay;
+};
+
+static struct fs_device *bench_dev;
+static u_long bench_seed;
+static u_char *bench_buf;
+
+/* The generator used by the random workloads. Not a good one, but the
+   same on every host. */
+static u_long
+bench_random(u_long limit)
+{
+    u_long hi, lo;
+    bench_seed = (bench_seed * 1103515245 + 12345) & 0xffffffff;
+    hi = (bench_seed >> 16) & 0x7fff;
+    bench_seed = (bench_seed * 1103515245 + 12345) & 0xffffffff;
+    lo = (bench_seed >> 16) & 0x7fff;
+    return ((hi << 15) | lo) % limit;
+}
+
+static void
+bench_name(char *buf, int i)
+{
+    sprintf(buf, BENCH_DIR "/f%05d", i);
+}
+
+static void
+get_counts(struct bench_counts *c)
+{
+    gettimeofday(&c->time, NULL);
+    get_buffer_stats(&c->buf);
+    c->inodes = inode_stats;
+    get_device_stats(bench_dev, &c->dev);
+    c->delay = test_dev_delay;
+}
+
+/* Start a workload: write back and drop the cache, then take the
+   counters. */
+static void
+begin_phase(struct bench_counts *before)
+{
+    sync_buffers();
+    flush_device_cache(bench_dev, FALSE);
+    get_counts(before);
+}
+
+/* Finish the workload NAME (which did OPS operations transferring BYTES
+   bytes) and print its results. Dirty blocks are written back first so
+   that writes are charged to the workload which made them. */
+static void
+end_phase(struct shell *sh, const char *name, u_long ops, u_long bytes,
+	  struct bench_counts *before)
+{
+    struct bench_counts after;
+    double secs, hit, inode_hit;
+    u_long accessed, lookups;
+    sync_buffers();
+    get_counts(&after);
+    secs = ((after.time.tv_sec - before->time.tv_sec)
+	    + (after.time.tv_usec - before->time.tv_usec) / 1000000.0);
+    if(secs <= 0)
+	secs = 0.000001;
+    accessed = after.buf.total_accessed - before->buf.total_accessed;
+    hit = (accessed == 0 ? 100.0
+	   : ((after.buf.cached_accesses - before->buf.cached_accesses)
+	      * 100.0 / accessed));
+    lookups = ((after.inodes.hits + after.inodes.misses)
+	       - (before->inodes.hits + before->inodes.misses));
+    inode_hit = (lookups == 0 ? 100.0
+		 : ((after.inodes.hits - before->inodes.hits)
+		    * 100.0 / lookups));
+    printf("%-10s %8lu %8.3f %10.0f %9.0f %6.1f %6.1f %6lu/%-7lu %6lu/%-7lu"
+	   " %7.3f\n",
+	   name, ops, secs, ops / secs, bytes / secs / 1024, hit, inode_hit,
+	   after.dev.reads - before->dev.reads,
+	   after.dev.blocks_read - before->dev.blocks_read,
+	   after.dev.writes - before->dev.writes,
+	   after.dev.blocks_written - before->dev.blocks_written,
+	   (after.delay - before->delay) / 1000000.0);
+    fflush(stdout);
+}
+
+static bool
+bench_create(struct shell *sh, int nfiles)
+{
+    struct bench_counts c;
+    char name[40];
+    int i;
+    begin_phase(&c);
+    for(i = 0; i < nfiles; i++)
+    {
+	struct file *f;
+	bench_name(name, i);
+	f = create_file(name, 0);
+	if(f == NULL)
+	    return FALSE;
+	close_file(f);
+    }
+    end_phase(sh, "create", nfiles, 0, &c);
+    return TRUE;
+}
+
+static bool
+bench_lookup(struct shell *sh, int nfiles)
+{
+    struct bench_counts c;
+    char name[40];
+    int i;
+    begin_phase(&c);
+    for(i = 0; i < nfiles * BENCH_LOOKUPS; i++)
+    {
+	struct file *f;
+	bench_name(name, bench_random(nfiles));
+	f = open_file(name, F_READ);
+	if(f == NULL)
+	    return FALSE;
+	close_file(f);
+    }
+    end_phase(sh, "lookup", nfiles * BENCH_LOOKUPS, 0, &c);
+    return TRUE;
+}
+
+static bool
+bench_list(struct shell *sh)
+{
+    struct bench_counts c;
+    struct dir_plus ents[DIR_PLUS_MAX];
+    struct file *dir;
+    u_long total = 0;
+    int i;
+    begin_phase(&c);
+    dir = open_file(BENCH_DIR, F_READ | F_ALLOW_DIR);
+    if(dir == NULL)
+	return FALSE;
+    for(i = 0; i < BENCH_LISTS; i++)
+    {
+	long entries;
+	seek_file(dir, 0, SEEK_ABS);
+	while((entries = read_dir_plus(dir, ents, DIR_PLUS_MAX)) > 0)
+	    total += entries;
+	if(entries < 0)
+	{
+	    close_file(dir);
+	    return FALSE;
+	}
+    }
+    close_file(dir);
+    end_phase(sh, "list", total, 0, &c);
+    return TRUE;
+}
+
+static bool
+bench_sequential(struct shell *sh, size_t size, bool write)
+{
+    struct bench_counts c;
+    struct file *f;
+    size_t done = 0;
+    begin_phase(&c);
+    f = open_file(BENCH_DIR "/seq",
+		  write ? (F_WRITE | F_CREATE | F_TRUNCATE) : F_READ);
+    if(f == NULL)
+	return FALSE;
+    while(done < size)
+    {
+	long actual = (write ? write_file(bench_buf, BENCH_SEQ_CHUNK, f)
+		       : read_file(bench_buf, BENCH_SEQ_CHUNK, f));
+	if(actual != BENCH_SEQ_CHUNK)
+	{
+	    close_file(f);
+	    return FALSE;
+	}
+	done += actual;
+    }
+    close_file(f);
+    end_phase(sh, write ? "seqwrite" : "seqread",
+	      size / BENCH_SEQ_CHUNK, size, &c);
+    return TRUE;
+}
+
+static bool
+bench_random_io(struct shell *sh, size_t size, int ops, bool write)
+{
+    struct bench_counts c;
+    struct file *f;
+    int i;
+    begin_phase(&c);
+    f = open_file(BENCH_DIR "/seq", F_READ | (write ? F_WRITE : 0));
+    if(f == NULL)
+	return FALSE;
+    for(i = 0; i < ops; i++)
+    {
+	long pos = bench_random(size / BENCH_RAND_SIZE) * BENCH_RAND_SIZE;
+	long actual;
+	if(seek_file(f, pos, SEEK_ABS) < 0)
+	    goto error;
+	actual = (write ? write_file(bench_buf, BENCH_RAND_SIZE, f)
+		  : read_file(bench_buf, BENCH_RAND_SIZE, f));
+	if(actual != BENCH_RAND_SIZE)
+	    goto error;
+    }
+    close_file(f);
+    end_phase(sh, write ? "randwrite" : "randread",
+	      ops, ops * BENCH_RAND_SIZE, &c);
+    return TRUE;
+
+error:
+    close_file(f);
+    return FALSE;
+}
+
+static bool
+bench_delete(struct shell *sh, int nfiles)
+{
+    struct bench_counts c;
+    char name[40];
+    int i;
+    begin_phase(&c);
+    for(i = 0; i < nfiles; i++)
+    {
+	bench_name(name, i);
+	if(!remove_link(name))
+	    return FALSE;
+    }
+    if(!remove_link(BENCH_DIR "/seq") || !remove_directory(BENCH_DIR))
+	return FALSE;
+    end_phase(sh, "delete", nfiles + 2, 0, &c);
+    return TRUE;
+}
+
+#define DOC_bench "bench [SCALE]\n\
+Run the file system benchmarks in the directory `" BENCH_DIR "' (which\n\
+mustn't exist) of the current device, printing the results of each.\n\
+SCALE multiplies the size of each workload, by default it's one."
+int
+cmd_bench(struct shell *sh, int argc, char **argv)
+{
+    int scale = 1, nfiles;
+    struct file *cwd;
+    size_t seq_size;
+    bool ok;
+    if(argc > 1)
+	return shell->arg_error(sh);
+    if(argc == 1)
+    {
+	scale = atoi(argv[0]);
+	if(scale < 1)
+	    return shell->arg_error(sh);
+    }
+    nfiles = BENCH_FILES * scale;
+    seq_size = BENCH_SEQ_SIZE * scale;
+    cwd = get_current_dir();
+    if(cwd == NULL)
+    {
+	shell->perror(sh, "bench");
+	return RC_FAIL;
+    }
+    bench_dev = cwd->inode->dev;
+    bench_buf = malloc(BENCH_SEQ_CHUNK);
+    if(bench_buf == NULL || !make_directory(BENCH_DIR, 0))
+    {
+	shell->perror(sh, BENCH_DIR);
+	free(bench_buf);
+	close_file(cwd);
+	return RC_FAIL;
+    }
+    memset(bench_buf, 0x5a, BENCH_SEQ_CHUNK);
+    bench_seed = 1;
+    printf("%d-byte blocks, scale %d\n"
+	   "%-10s %8s %8s %10s %9s %6s %6s %14s %14s %7s\n",
+	   FS_BLKSIZ, scale, "workload", "ops", "secs", "ops/s", "KB/s",
+	   "hit%", "inode%", "dev-reads/blks", "dev-writes/blks", "delay");
+    ok = (bench_create(sh, nfiles)
+	  && bench_lookup(sh, nfiles)
+	  && bench_list(sh)
+	  && bench_sequential(sh, seq_size, TRUE)
+	  && bench_sequential(sh, seq_size, FALSE)
+	  && bench_random_io(sh, seq_size, BENCH_RAND_OPS * scale, TRUE)
+	  && bench_random_io(sh, seq_size, BENCH_RAND_OPS * scale, FALSE)
+	  && bench_delete(sh, nfiles));
+    free(bench_buf);
+    close_file(cwd);
+    if(!ok)
+    {
+	shell->perror(sh, "bench");
+	return RC_FAIL;
+    }
+    return RC_OK;
+}
+
+void
+add_bench_command(void)
+{
+    shell->add_command("bench", cmd_bench, DOC_bench);
+}
+
+void
+remove_bench_command(void)
+{
+    shell->remove_command("bench");
+}
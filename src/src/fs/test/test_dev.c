@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define __NO_TYPE_CLASHES
 #include <vmm/fs.h>
@@ -24,6 +25,61 @@ static struct fs_device *test_dev;
 /* So we can simulate removing and inserting disks. */
 static bool no_disk, disk_changed;
 
+/* Simulated access times (see the `latency' command), each request
+   sleeps for BLOCK-USECS per block plus SEEK-USECS unless it starts at
+   the block after the previous request. */
+static u_long seek_usecs, block_usecs;
+static blkno next_blk;
+
+/* Total microseconds slept by simulated accesses. */
+u_long test_dev_delay;
+
+/* A rough old IDE disk: 12ms to seek and rotate, 3MB/s transfers. */
+#define IDE_SEEK_USECS 12000
+#define IDE_BLOCK_USECS (FS_BLKSIZ / 3)
+
+static void
+dev_delay(blkno blk, int count)
+{
+    u_long usecs = count * block_usecs;
+    if(blk != next_blk)
+	usecs += seek_usecs;
+    next_blk = blk + count;
+    if(usecs > 0)
+    {
+	test_dev_delay += usecs;
+	usleep(usecs);
+    }
+}
+
+#define DOC_latency "latency [off | ide | SEEK-USECS BLOCK-USECS]\n\
+Make each access to the test device take as long as it would on a slow\n\
+disk: BLOCK-USECS microseconds for each block transferred, plus\n\
+SEEK-USECS unless the access follows on from the previous one. `ide'\n\
+chooses values like those of an old IDE disk, `off' turns this off.\n\
+With no arguments prints the current values."
+int
+cmd_latency(struct shell *sh, int argc, char **argv)
+{
+    if(argc == 1 && !strcmp(argv[0], "off"))
+	seek_usecs = block_usecs = 0;
+    else if(argc == 1 && !strcmp(argv[0], "ide"))
+    {
+	seek_usecs = IDE_SEEK_USECS;
+	block_usecs = IDE_BLOCK_USECS;
+    }
+    else if(argc == 2)
+    {
+	seek_usecs = strtoul(argv[0], NULL, 0);
+	block_usecs = strtoul(argv[1], NULL, 0);
+    }
+    else if(argc != 0)
+	return shell->arg_error(sh);
+    shell->printf(sh, "Seek %d us, %d us per block (%d us slept so far).\n",
+		  seek_usecs, block_usecs, test_dev_delay);
+    return RC_OK;
+}
+
 #define DOC_nodisk "nodisk\n\
 Simulate removing the disk from the floppy drive."
 int
@@ -88,6 +144,8 @@ open_test_dev(const char *file, u_long blocks, bool make_fs, u_long reserved)
 	add_device(test_dev);
 	shell->add_command("nodisk", cmd_nodisk, DOC_nodisk);
 	shell->add_command("newdisk", cmd_newdisk, DOC_newdisk);
+	shell->add_command("latency", cmd_latency, DOC_latency);
+	add_bench_command();
 	return TRUE;
     }
     else
@@ -104,6 +162,8 @@ close_test_dev(void)
     remove_device(test_dev);
     close(dev_fd);
     dev_fd = -1;
+    remove_bench_command();
+    shell->remove_command("latency");
     shell->remove_command("newdisk");
     shell->remove_command("nodisk");
 }
@@ -114,6 +174,7 @@ dev_read_blocks(void *unused, blkno blk, void *buf, int count)
     long actual;
     if(no_disk)
 	return E_NODISK;
+    dev_delay(blk, count);
     if(lseek(dev_fd, blk * FS_BLKSIZ, SEEK_SET) < 0)
     {
 	perror("read_block:lseek");
@@ -138,6 +199,7 @@ dev_write_blocks(void *unused, blkno blk, void *buf, int count)
     long actual;
     if(no_disk)
 	return E_NODISK;
+    dev_delay(blk, count);
     if(lseek(dev_fd, blk * FS_BLKSIZ, SEEK_SET) < 0)
     {
 	perror("write_block:lseek");
@@ -27,7 +27,7 @@ struct kernel_module kernel_module =
     /* mm functions */
     alloc_page, alloc_pages_64, free_page, free_pages, map_page, set_pte,
     get_pte, read_page_mapping, lin_to_phys, put_pd_val, get_pd_val,
-    check_area,
+    check_area, free_page_count, add_page_shrinker, remove_page_shrinker,
 
     /* kernel malloc */
     malloc, calloc, free, realloc, valloc,
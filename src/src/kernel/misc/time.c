@@ -7,6 +7,7 @@
 
 #ifdef TEST
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <time.h>
 #define __NO_TYPE_CLASHES
@@ -265,6 +266,17 @@ current_time(void)
 #endif
 }
 
+#ifdef TEST
+/* Simulate the 1024Hz timer with the Unix clock. */
+u_long
+get_timer_ticks(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1024) + ((tv.tv_usec * 1024) / 1000000);
+}
+#endif
+
 
 /* Time output stuff. */
 
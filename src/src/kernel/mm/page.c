@@ -15,6 +15,24 @@ page_dir *logical_kernel_pd;		/* Initialised in init_mm() */
 static page *page_free_list = NULL;
 static int used_pages = 0, available_pages = 0;
 
+static struct page_shrinker *shrinker_list;
+
+/* Ask each registered shrinker to give back some pages, stopping as
+   soon as COUNT pages have been freed. Returns the number freed. This
+   must be called with interrupts masked. */
+static u_long
+shrink_pages(u_long count)
+{
+    struct page_shrinker *s = shrinker_list;
+    u_long freed = 0;
+    while(s != NULL && freed < count)
+    {
+	freed += s->func(count - freed);
+	s = s->next;
+    }
+    return freed;
+}
+
 /* Allocate one free page and return its *logical* address. If no free
    pages exist, return NULL. */
 page *
@@ -24,6 +42,8 @@ alloc_page(void)
     page *p;
     save_flags(flags);
     cli();
+    if(page_free_list == NULL)
+	shrink_pages(1);
     p = page_free_list;
     DB(("alloc_page: p=%p\n", page_free_list));
     if(p != NULL)
@@ -149,6 +169,38 @@ free_page_count(void)
     return available_pages;
 }
 
+/* Install SHRINKER so that it's called when memory runs out. */
+void
+add_page_shrinker(struct page_shrinker *shrinker)
+{
+    int flags;
+    save_flags(flags);
+    cli();
+    shrinker->next = shrinker_list;
+    shrinker_list = shrinker;
+    load_flags(flags);
+}
+
+void
+remove_page_shrinker(struct page_shrinker *shrinker)
+{
+    struct page_shrinker **x;
+    int flags;
+    save_flags(flags);
+    cli();
+    x = &shrinker_list;
+    while(*x != NULL)
+    {
+	if(*x == shrinker)
+	{
+	    *x = shrinker->next;
+	    break;
+	}
+	x = &(*x)->next;
+    }
+    load_flags(flags);
+}
+
 
 /* Page table & directory manipulation. */
 
@@ -280,10 +280,14 @@ source_file(struct shell *sh, const char *file_name)
     {
 	struct shell subsh;
 	memcpy(&subsh, sh, sizeof(subsh));
-	subsh.src = fh;
-	shell_loop(&subsh);
+	subsh.src = fs->open_stream(fh, 0);
+	if(subsh.src != NULL)
+	{
+	    shell_loop(&subsh);
+	    fs->close_stream(subsh.src);
+	}
 	fs->close(fh);
-	return TRUE;
+	return subsh.src != NULL;
     }
 #endif
     return FALSE;
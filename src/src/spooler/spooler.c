@@ -41,22 +41,28 @@ add_spool_file(char *fname)
             dst = fs->open(new->spool_name, F_WRITE | F_TRUNCATE | F_CREATE);
             if(dst != NULL) {
                 int actual;
+                /* A block may be too big for the stack. */
+                u_char *buf = (u_char *)kernel->malloc(FS_BLKSIZ);
+                if(buf == NULL)
+                    goto error;
 
                 do {
                     int wrote;
-                    u_char buf[FS_BLKSIZ];
-                    actual = fs->read(&buf, FS_BLKSIZ, src);
+                    actual = fs->read(buf, FS_BLKSIZ, src);
                     if(actual < 0)
                         goto error;
-                    wrote = fs->write(&buf, actual, dst);
+                    wrote = fs->write(buf, actual, dst);
                     if(wrote != actual)
                     {
                     error:
+                        if(buf != NULL)
+                            kernel->free(buf);
                         fs->close(dst);
                         fs->close(src);
                         return FALSE;
                     }
                 } while(actual > 0);
+                kernel->free(buf);
                 fs->close(dst);
             }
             else {
@@ -33,8 +33,14 @@ void syslog_task(void)
   char *p;
 #ifdef DEBUG
   LogFp = fs->open(LOG_NAME, F_WRITE | F_CREATE);
-  fs->fprintf(LogFp, "syslogd initialised ok!!\n");
-  fs->close(LogFp);
+  if(LogFp != NULL) {
+    struct fs_stream *s = fs->open_stream(LogFp, 0);
+    if(s != NULL) {
+      fs->fprintf(s, "syslogd initialised ok!!\n");
+      fs->close_stream(s);
+    }
+    fs->close(LogFp);
+  }
 #endif
 
   while(1) {
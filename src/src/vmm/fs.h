@@ -15,10 +15,18 @@
 # include <vmm/shell.h>
 #endif
 
-/* Perhaps it would be better to use 1024-byte blocks.. The value 512 isn't
-   hardcoded anywhere so it would be easy to switch.. (It has to be some
-   power of 2 though.) */
-#define FS_BLKSIZ 1024
+/* The size of a file system block. This can be changed when building by
+   setting FS_BLKSIZ in the make command (see Makedefs), everything using
+   the file system has to be built with the same value. Bigger blocks
+   mean fewer blocks to map and transfer for each file, but only 1024-byte
+   blocks can be booted from (start16 assumes it). mkfs records the size
+   in the boot block and file systems with a different size are refused. */
+#ifndef FS_BLKSIZ
+# define FS_BLKSIZ 1024
+#endif
+#if (FS_BLKSIZ & (FS_BLKSIZ - 1)) || (FS_BLKSIZ < 1024) || (FS_BLKSIZ > 4096)
+# error "FS_BLKSIZ has to be 1024, 2048 or 4096"
+#endif
 
 
 /* The boot block is the first on the device (surprise, surprise..) */
@@ -38,6 +46,10 @@ typedef u_char blk[FS_BLKSIZ];
 	+ - - - - - - - - -+
 	|   Data bitmap    |
 	+- - - - - - - - - +
+	| Reference counts |  (optional, see below)
+	+- - - - - - - - - +
+	|  Metadata log    |  (optional)
+	+- - - - - - - - - +
 	|   Data blocks    |  */
 
 struct super_data {
@@ -50,15 +62,58 @@ struct super_data {
     u_long data_size;		/* Number of data blocks, size of bitmap. */
 };
 
+/* Extra super-block information, kept in the second half of the boot
+   block so that the layout of the first half doesn't change. It's only
+   valid if MAGIC is FS_EXT_MAGIC, older file systems don't have it (and
+   use 1024-byte blocks). */
+struct super_ext {
+    u_long magic;
+    blkno log_start;		/* the metadata log's header block */
+    u_long log_size;		/* blocks in the log, zero if none */
+    u_long block_size;		/* FS_BLKSIZ of the mkfs that made it */
+    u_long features;		/* FS_FEAT_ flags */
+    blkno refcount_start;	/* the block reference counts */
+    u_long refcount_size;
+};
+#define FS_EXT_MAGIC 0x54584553
+
+/* Bits in super_ext.features, things older versions of the file system
+   don't understand. */
+#define FS_FEAT_INLINE	1	/* small files are stored in their inodes */
+#define FS_FEAT_REFCOUNT 2	/* data blocks have reference counts */
+
 struct boot_blk {
     char boot_code[512 - 4 - sizeof(struct super_data)];
     struct super_data sup;
     u_long magic;
-    char reserved[FS_BLKSIZ - 512];
+    struct super_ext ext;
+    char reserved[FS_BLKSIZ - 512 - sizeof(struct super_ext)];
 };
 #define FS_BOOT_MAGIC   0xAA554d57
 #define FS_NOBOOT_MAGIC 0x00004d57
 
+/* The metadata log. Changes to the bitmaps, inodes, indirect blocks and
+   directories are collected into transactions in memory, each one is
+   written to the log (the changed blocks followed by this header) before
+   any of its blocks are written to their real locations. After a crash
+   the last transaction in the log is copied back, if its checksum is
+   correct. See journal.c. */
+#define LOG_MAX_BLOCKS ((FS_BLKSIZ - 4 * sizeof(u_long)) / sizeof(blkno))
+struct log_header {
+    u_long magic;
+    u_long sequence;
+    u_long nr_blocks;		/* zero if the log is empty */
+    u_long checksum;		/* of the sequence and logged blocks */
+    blkno home[LOG_MAX_BLOCKS];	/* where each logged block belongs */
+};
+#define FS_LOG_MAGIC 0x474f4c4d
+
+/* mkfs gives each device a log of FS_LOG_SIZE blocks (including the
+   header), or one of a thirty-second of the device if that's smaller. No
+   log is made if it would have less than FS_LOG_MIN blocks. */
+#define FS_LOG_SIZE 17
+#define FS_LOG_MIN 5
+
 /* An inode as stored on disk. */
 struct inode {
     u_long attr;
@@ -66,7 +121,8 @@ struct inode {
     time_t modtime;
     u_long nlinks;
     /* Pointers to data blocks. data[9->11] are single, double and
-       triple indirect blocks. */
+       triple indirect blocks. If ATTR_INLINE is set this holds the
+       file's contents instead. */
     u_long data[12];
 };
 
@@ -76,6 +132,15 @@ struct inode {
 #define ATTR_MODE_MASK	0x000000ff
 #define ATTR_DIRECTORY	0x00010000
 #define ATTR_SYMLINK	0x00020000
+#define ATTR_INLINE	0x00040000
+#define ATTR_CLONED	0x00080000	/* may share blocks, see clone_file() */
+
+/* On devices with the FS_FEAT_INLINE feature files and symbolic links
+   of no more than INLINE_MAX bytes are stored in the `data' field of
+   their inode, saving a block and the read of it. They're moved to a
+   data block as soon as they grow any bigger. */
+#define INLINE_MAX sizeof(((struct inode *)0)->data)
+#define INLINE_DATA(ci) ((u_char *)(ci)->inode.data)
 
 #define SINGLE_INDIRECT 9
 #define DOUBLE_INDIRECT 10
@@ -94,21 +159,49 @@ struct indirect_blk {
     blkno data[PTRS_PER_INDIRECT];
 };
 
+/* A run of logical blocks stored in consecutive physical blocks. */
+struct bmap_extent {
+    blkno logical;
+    blkno physical;
+    u_long count;		/* zero if unused */
+};
+#define BMAP_CACHE_SIZE 4
+
 /* An inode as stored in memory. */
 struct core_inode {
-    struct core_inode *next;
+    list_node_t node;		/* in the LRU list when unreferenced */
+    struct core_inode *next;	/* in the free list */
+    struct core_inode *hash_next;
     int use_count;
     struct fs_device *dev;
     struct inode inode;
     u_long inum;
     bool dirty;
     bool invalid;
+    struct dir_index *dir_index; /* hashed entries if a directory, see dir.c */
+    struct bmap_extent bmap_cache[BMAP_CACHE_SIZE]; /* see inode.c */
+    int bmap_last;		/* extent last used */
+    blkno prealloc_start;	/* blocks reserved for appending writes */
+    u_long prealloc_count;
 #ifndef TEST
     bool locked;
     struct task_list *locked_tasks;
 #endif
 };
-#define NR_INODES 30
+#define INODE_HASH_SIZE 64	/* must be a power of two */
+#define INODE_CACHE_MAX 64	/* max unreferenced inodes kept in core */
+
+/* In-core inode statistics, see inode.c. */
+struct inode_stats {
+    u_long nr_inodes;		/* core_inode structures allocated */
+    u_long nr_cached;		/* of which unreferenced, on the LRU list */
+    u_long hits;		/* make_inode() found the inode in core */
+    u_long misses;		/* make_inode() had to read the inode */
+    u_long recycled;		/* unreferenced inodes reused */
+    u_long bmap_hits;		/* get_data_blkno() found the block cached */
+    u_long bmap_misses;		/* get_data_blkno() walked the pointers */
+    u_long cow_copies;		/* shared blocks copied when written */
+};
 
 /* A file handle. */
 struct file {
@@ -116,9 +209,25 @@ struct file {
     struct core_inode *inode;
     u_long mode;
     u_long pos;
+
+    /* Read-ahead state. RA-NEXT is the logical block a sequential reader
+       would read next, blocks before RA-END have already been read ahead
+       and RA-WINDOW is the current number of blocks to read ahead. */
+    blkno ra_next;
+    blkno ra_end;
+    u_long ra_window;
 };
 #define NR_FILES 50
 
+/* The read-ahead window starts at RA_MIN_BLOCKS and doubles on each
+   sequential access up to RA_MAX_BLOCKS. */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 16
+
+/* When a write extends a file at least PREALLOC_BLOCKS contiguous blocks
+   are reserved for it, see reserve_blocks(). */
+#define PREALLOC_BLOCKS 16
+
 /* Modes for opening files. */
 #define F_READ		1	/* Open for reading. */
 #define F_WRITE		2	/* Open for writing. */
@@ -126,6 +235,11 @@ struct file {
 #define F_TRUNCATE	8	/* Truncate the file to zero bytes. */
 #define F_ALLOW_DIR	16	/* Allow the opening of directories. */
 #define F_DONT_LINK	32	/* Don't follow symlinks. */
+#define F_DIRECT	64	/* Transfer whole blocks directly. */
+
+/* With F_DIRECT, whole block transfers bypass the buffer cache. Each
+   device request moves at most DIRECT_MAX_BLOCKS blocks (64K). */
+#define DIRECT_MAX_BLOCKS (65536 / FS_BLKSIZ)
 
 /* Operations on file handles. */
 #define F_ATTR(f)	((f)->inode->inode.attr)
@@ -140,6 +254,35 @@ struct file {
 #define F_WRITEABLE(f)	(!(F_ATTR(f) & ATTR_NO_WRITE))
 #define F_EXECABLE(f)	((F_ATTR(f) & ATTR_EXEC))
 
+/* A segment of memory for read_file_vec() and write_file_vec(). */
+struct fs_iovec {
+    void *base;
+    size_t len;
+};
+
+/* An asynchronous file request, see aio.c. Like a blkreq_t it is owned
+   by the caller, queued on submission and signals SEM when COMPLETED. */
+struct fs_request {
+    list_node_t node;
+    struct file *file;			/* File to access */
+    void *buf;				/* Data being read/written */
+    size_t len;				/* Number of bytes to transfer */
+    long offset;			/* Position in file, or FS_REQ_CUR_POS */
+    int command;			/* FS_REQ_READ or FS_REQ_WRITE */
+    long result;			/* := bytes transferred or -error */
+    bool completed;			/* TRUE when request has finished */
+    struct semaphore sem;		/* Task waiting on this request. */
+    /* If non-null called (by the fs-aio task, inside a FORBID()) when
+       the request has been performed, before COMPLETED is set and SEM
+       is signalled. */
+    void (*callback)(struct fs_request *req);
+    void *user_data;
+};
+
+#define FS_REQ_READ	0
+#define FS_REQ_WRITE	1
+#define FS_REQ_CUR_POS	(-1)
+
 /* TYPE arguments to seek_file(). */
 #define SEEK_ABS	0	/* N bytes from the start of the file. */
 #define SEEK_REL	1	/* N bytes from the current position. */
@@ -149,6 +292,18 @@ struct file {
 # define EOF (-1)
 #endif
 
+/* A buffered stream on a file handle, see lib.c. Unless its creator says
+   otherwise a stream has a buffer of FS_STREAM_BUFSIZ bytes. */
+#define FS_STREAM_BUFSIZ 1024
+struct fs_stream {
+    struct file *file;
+    u_char *buf;
+    size_t size;		/* size of BUF */
+    size_t pos;			/* next byte of BUF to read or write */
+    size_t len;			/* bytes of read-ahead data in BUF */
+    bool writing;		/* BUF[0..POS) is output not yet written */
+};
+
 #define NAME_MAX 27
 struct dir_entry {
     char name[NAME_MAX + 1];	/* a null name means a free slot. */
@@ -161,38 +316,210 @@ struct dir_entry_blk {
     char pad[FS_BLKSIZ - (DIR_ENTRIES_PER_BLOCK * sizeof(struct dir_entry))];
 };
 
+/* A directory entry and the details from its inode, as returned by
+   read_dir_plus(). No more than DIR_PLUS_MAX are returned by each call. */
+struct dir_plus {
+    char name[NAME_MAX + 1];
+    u_long inum;
+    u_long attr;
+    size_t size;
+    time_t modtime;
+    u_long nlinks;
+};
+#define DIR_PLUS_MAX 64
+
+/* Directories with at least DIR_INDEX_MIN entries get an in-core hash
+   index of their entries the first time they're searched. */
+#define DIR_INDEX_MIN 16
+#define DIR_INDEX_BUCKETS 64	/* must be a power of two */
+
+/* Size of the name lookup cache in dir.c. */
+#define DCACHE_SIZE 64
+#define DCACHE_BUCKETS 32	/* must be a power of two */
+
 
-/* One buffer in the buffer cache. Currently a limited number of buffers
-   are allocated statically, none dynamically. */
+/* The contents of one block as seen through the buffer cache. */
+union blk_data {
+    blk data;
+    struct boot_blk boot;
+    struct inode_blk inodes;
+    struct dir_entry_blk dir;
+    struct indirect_blk ind;
+    u_long bmap[FS_BLKSIZ / 4];
+};
+
+/* One buffer in the buffer cache. Buffers are allocated a page at a time
+   (see struct buf_page in buffer.c), the block data lives in the page
+   and BUF points into it. */
 struct buf_head {
-    union {
-	list_node_t node;
-	struct buf_head *next_free;
-    } link;
+    list_node_t node;		/* in the list given by `lru' */
+    struct buf_head *hash_next;
+    struct buf_page *page;	/* the page this buffer belongs to */
     struct fs_device *dev;
     blkno blkno;
+    u_long last_access;		/* value of total_accessed when last used */
+    u_long dirty_time;		/* timer ticks when first made dirty */
     short use_count;
+    char lru;			/* BUF_FREE, BUF_INACTIVE or BUF_ACTIVE */
+    char type;			/* BUF_CLASS_DATA etc... */
     bool dirty;
     bool invalid;
+    bool read_ahead;		/* read ahead, not yet used */
+    bool writing;		/* being written by write_buffer() */
+    bool write_error;		/* last write-back failed, don't evict */
+    u_char transactions;	/* journal transactions holding it */
 #ifndef TEST
     bool locked;
     struct task_list *locked_tasks;
 #endif
-    union {
-	blk data;
-	struct boot_blk boot;
-	struct inode_blk inodes;
-	struct dir_entry_blk dir;
-	struct indirect_blk ind;
-	u_long bmap[FS_BLKSIZ / 4];
-    } buf;
+    union blk_data *buf;
 };
 
+/* The buffer cache grows while there's more than BUF_FREE_RESERVE pages
+   of free memory and never shrinks below NR_BUFFERS buffers. */
 #define NR_BUFFERS 20
-#define BUFFER_BUCKETS 4
-#define BUFFER_HASH(blkno) ((blkno) % BUFFER_BUCKETS)
+#define BUFS_PER_PAGE (PAGE_SIZE / FS_BLKSIZ)
+#define BUF_FREE_RESERVE 64
+
+/* Values of buf_head.lru. New blocks go onto the inactive list; they're
+   only moved to the active list if they're used again more than
+   BUF_CORRELATED_ACCESSES block accesses after their previous use, so
+   that reading a big file once can't push everything else out. No more
+   than BUF_ACTIVE_PERCENT percent of the buffers may be active. */
+#define BUF_FREE 0
+#define BUF_INACTIVE 1
+#define BUF_ACTIVE 2
+#define BUF_NR_LISTS 3
+#define BUF_CORRELATED_ACCESSES 8
+#define BUF_ACTIVE_PERCENT 75
+
+/* Values of buf_head.type, what the block is used for. When a buffer
+   is needed for a new block, data buffers are evicted before any of the
+   other (metadata) classes unless more than BUF_META_PERCENT percent of
+   the cache holds metadata. */
+#define BUF_CLASS_DATA 0
+#define BUF_CLASS_DIR 1
+#define BUF_CLASS_INDIRECT 2
+#define BUF_CLASS_INODE 3
+#define BUF_CLASS_BITMAP 4
+#define BUF_NR_CLASSES 5
+#define BUF_META_PERCENT 50
+
+/* Default settings of the bdflush task. Every BDFLUSH_INTERVAL ticks it
+   writes any buffers which have been dirty for BDFLUSH_AGE ticks, and
+   more if over BDFLUSH_RATIO percent of the cache is dirty. Once
+   BDFLUSH_LIMIT percent is dirty brelse() writes buffers itself. */
+#define BDFLUSH_INTERVAL 1024
+#define BDFLUSH_AGE (5 * 1024)
+#define BDFLUSH_RATIO 30
+#define BDFLUSH_LIMIT 60
+
+/* When a dirty buffer is written back, dirty buffers holding the blocks
+   next to it are written by the same request, up to WB_MAX_BLOCKS. */
+#define WB_MAX_BLOCKS 16
+
+/* The hash table starts with BUFFER_HASH_MIN chains and is doubled
+   whenever the average chain would be longer than BUFFER_HASH_LOAD. */
+#define BUFFER_HASH_MIN 16
+#define BUFFER_HASH_LOAD 2
+#define BUFFER_HASH(dev, blkno, mask) \
+    (((blkno) ^ ((blkno) >> 8) ^ ((u_long)(dev) >> 4)) & (mask))
+
+/* Blocks being added to the cache are locked by one of BUFFER_LOCKS
+   semaphores (a power of two). */
+#define BUFFER_LOCKS 16
+#define BUFFER_LOCK(dev, blkno) BUFFER_HASH(dev, blkno, BUFFER_LOCKS - 1)
+
+/* Buffer cache statistics, as returned by get_buffer_stats(). All times
+   are in timer ticks. Bucket 0 of the read latency histogram counts
+   reads which took no time, bucket N reads taking 2^(N-1) ticks or more
+   but less than 2^N (the last bucket has no upper limit). */
+#define BUF_LATENCY_BUCKETS 8
+struct buffer_stats {
+    /* The state of the cache when the statistics were taken. */
+    u_long nr_buffers, hash_size;
+    u_long list_len[BUF_NR_LISTS];
+    u_long class_len[BUF_NR_CLASSES];
+    u_long nr_dirty, dirty_age_total, dirty_age_max;
+
+    /* Block accesses through the cache. */
+    u_long total_accessed, cached_accesses, dirty_accesses;
+    u_long class_hits[BUF_NR_CLASSES], class_misses[BUF_NR_CLASSES];
+    u_long read_latency[BUF_LATENCY_BUCKETS];
+
+    /* The age of an evicted buffer is the number of block accesses
+       since it was last used. */
+    u_long evictions, active_evictions, evict_age_total, evict_age_min;
+
+    /* RA-HITS counts read-ahead blocks which were subsequently used,
+       RA-WASTED those evicted without being used. */
+    u_long ra_requests, ra_blocks, ra_hits, ra_wasted;
+
+    /* A block's write wait is the time between it first being made dirty
+       and it being written. */
+    u_long bdflush_runs, throttled_writes, write_requests, flushed_blocks;
+    u_long write_wait_total, write_wait_max;
+
+    /* Bucket and buffer locks. */
+    u_long bucket_locks_taken, bucket_lock_waits, buffer_lock_waits;
+    u_long lock_wait_total, lock_wait_max, lock_hold_total, lock_hold_max;
+
+    /* Transfers by files opened with F_DIRECT. */
+    u_long direct_requests, direct_blocks;
+};
+
+/* Statistics kept for each device. */
+struct fs_dev_stats {
+    u_long reads, blocks_read;		/* device requests */
+    u_long writes, blocks_written;
+    u_long hits, misses, evictions;	/* in the buffer cache */
+};
+
+
+/* In-core summary of one of a device's bitmaps, see bitmap.c. */
+struct bmap_info {
+    blkno start;		/* first block of the bitmap */
+    u_long len;			/* in bits */
+    u_long nr_blocks;
+    u_long rotor;		/* bit after the last one allocated */
+    short *block_free;		/* free bits in each block, -1 if unknown */
+    long nr_free;		/* total free bits, -1 if unknown */
+};
+
+/* In-core state of a device's metadata log, see journal.c. No more than
+   JOURNAL_MAX_BLOCKS buffers are held by a transaction since they can't
+   be evicted until it's committed. */
+#define JOURNAL_MAX_BLOCKS 16
+
+/* No request made by the fs may be longer than FS_MAX_REQ_SECTORS
+   512-byte sectors, the most an IDE drive's sector count register
+   can hold. */
+#define FS_MAX_REQ_SECTORS 255
+#if ((DIRECT_MAX_BLOCKS * (FS_BLKSIZ / 512)) > FS_MAX_REQ_SECTORS) \
+    || ((RA_MAX_BLOCKS * (FS_BLKSIZ / 512)) > FS_MAX_REQ_SECTORS) \
+    || ((WB_MAX_BLOCKS * (FS_BLKSIZ / 512)) > FS_MAX_REQ_SECTORS) \
+    || ((JOURNAL_MAX_BLOCKS * (FS_BLKSIZ / 512)) > FS_MAX_REQ_SECTORS)
+# error "A multi-block request is too long for FS_BLKSIZ"
+#endif
+
+struct journal {
+    blkno start;		/* the log header */
+    u_long max_blocks;		/* blocks per transaction */
+    u_long sequence;		/* of the last committed transaction */
+    /* The open transaction, its buffers sorted by block number. */
+    struct buf_head *open[JOURNAL_MAX_BLOCKS];
+    u_long nr_open;
+    /* The last committed transaction, until it's known to have reached
+       its home locations. */
+    blkno done[JOURNAL_MAX_BLOCKS];
+    u_long nr_done;
+    u_char *image;		/* copies of the committed blocks */
+    struct log_header *header;
+#ifndef TEST
+    struct semaphore lock;	/* held while committing */
+#endif
+};
 
-
 /* A device which the file system can access, there's a list of these
    somewhere. NAME is the device identifier. READ-BLOCK and WRITE-BLOCK
    are used to access the device. TEST-MEDIA is needed by devices with
@@ -229,15 +556,23 @@ struct fs_device {
     int use_count;		/* number of live references */
     bool read_only;		/* TRUE for write-protected devices */
     bool invalid;		/* TRUE when device is invalid */
+    struct fs_dev_stats stats;
+    struct bmap_info data_bmap;	/* summaries of the two bitmaps */
+    struct bmap_info inode_bmap;
+    struct journal *journal;	/* NULL if there's no metadata log */
+    u_long features;		/* from the boot block, FS_FEAT_ flags */
+    blkno refcount_start;	/* if FS_FEAT_REFCOUNT */
 };
 
 #define NR_DEVICES 20
 
-#define FS_READ_BLOCKS(dev, blk, buf, count) \
-    ((dev)->read_blocks((dev)->user_data, blk, buf, count))
+#define FS_READ_BLOCKS(dev, blk, buf, count)			\
+    ((dev)->stats.reads++, (dev)->stats.blocks_read += (count),	\
+     (dev)->read_blocks((dev)->user_data, blk, buf, count))
 
-#define FS_WRITE_BLOCKS(dev, blk, buf, count) \
-    ((dev)->write_blocks((dev)->user_data, blk, buf, count))
+#define FS_WRITE_BLOCKS(dev, blk, buf, count)			\
+    ((dev)->stats.writes++, (dev)->stats.blocks_written += (count), \
+     (dev)->write_blocks((dev)->user_data, blk, buf, count))
 
 
 struct fs_module {
@@ -256,10 +591,17 @@ struct fs_module {
     void (*close)(struct file *f);
     long (*read)(void *buf, size_t len, struct file *f);
     long (*write)(const void *buf, size_t len, struct file *f);
+    long (*read_vec)(const struct fs_iovec *iov, int count, struct file *f);
+    long (*write_vec)(const struct fs_iovec *iov, int count, struct file *f);
+    bool (*submit_request)(struct fs_request *req);
+    long (*wait_request)(struct fs_request *req);
+    bool (*cancel_request)(struct fs_request *req);
     long (*seek)(struct file *f, long arg, int type);
     struct file *(*dup)(struct file *f);
     bool (*truncate)(struct file *f);
     bool (*set_file_size)(struct file *f, size_t size);
+    bool (*preallocate)(struct file *f, size_t size);
+    struct file *(*clone_file)(const char *name, struct file *src);
     bool (*make_link)(const char *name, struct file *src);
     bool (*remove_link)(const char *name);
     bool (*set_file_mode)(const char *name, u_long modes);
@@ -268,6 +610,7 @@ struct fs_module {
     struct file *(*get_current_dir)(void);
     struct file *(*swap_current_dir)(struct file *dir);
     bool (*make_symlink)(const char *name, const char *link);
+    long (*read_dir_plus)(struct file *dir, struct dir_plus *ents, int count);
     bool (*mkfs)(struct fs_device *dev, u_long blocks, u_long reserved);
 
     /* Buffer-cache functions. */
@@ -275,14 +618,21 @@ struct fs_module {
     bool (*bwrite)(struct fs_device *dev, blkno blk, const void *data);
     void (*bdirty)(struct buf_head *bh, bool write_now);
     void (*brelse)(struct buf_head *bh);
+    void (*get_buffer_stats)(struct buffer_stats *stats);
+    void (*get_device_stats)(struct fs_device *dev, struct fs_dev_stats *stats);
 
     /* Library functions. */
-    int (*putc)(u_char c, struct file *fh);
-    int (*getc)(struct file *fh);
-    char *(*read_line)(char *buf, size_t bufsiz, struct file *fh);
-    int (*write_string)(const char *str, struct file *fh);
-    int (*fvprintf)(struct file *fh, const char *fmt, va_list args);
-    int (*fprintf)(struct file *fh, const char *fmt, ...);
+    struct fs_stream *(*open_stream)(struct file *file, size_t bufsiz);
+    bool (*close_stream)(struct fs_stream *s);
+    bool (*flush_stream)(struct fs_stream *s);
+    long (*read_stream)(void *buf, size_t len, struct fs_stream *s);
+    long (*write_stream)(const void *buf, size_t len, struct fs_stream *s);
+    int (*putc)(u_char c, struct fs_stream *s);
+    int (*getc)(struct fs_stream *s);
+    char *(*read_line)(char *buf, size_t bufsiz, struct fs_stream *s);
+    int (*write_string)(const char *str, struct fs_stream *s);
+    int (*fvprintf)(struct fs_stream *s, const char *fmt, va_list args);
+    int (*fprintf)(struct fs_stream *s, const char *fmt, ...);
 };
 
 #ifndef TEST
@@ -314,13 +664,34 @@ extern void invalidate_device(struct fs_device *dev);
 extern bool validate_device(struct fs_device *dev);
 
 /* from bitmap.c */
+extern void init_bmap_info(struct fs_device *dev);
+extern void free_bmap_info(struct fs_device *dev);
+extern long bmap_alloc_near(struct fs_device *dev, blkno bmap_start, u_long bmap_len, u_long goal);
 extern long bmap_alloc(struct fs_device *dev, blkno bmap_start, u_long bmap_len);
+extern bool bmap_free_run(struct fs_device *dev, blkno bmap_start, u_long bit, u_long count);
 extern bool bmap_free(struct fs_device *dev, blkno bmap_start, u_long bit);
+extern long bmap_alloc_run(struct fs_device *dev, blkno bmap_start, u_long bmap_len, u_long goal, u_long *countp);
+extern blkno alloc_blocks(struct fs_device *dev, blkno locality, u_long *countp);
 extern blkno alloc_block(struct fs_device *dev, blkno locality);
 extern bool free_block(struct fs_device *dev, blkno blk);
+extern bool free_blocks(struct fs_device *dev, blkno blk, u_long count);
+extern long bmap_count_free(struct fs_device *dev, struct bmap_info *info);
+extern long block_refs(struct fs_device *dev, blkno blk);
+extern bool share_block(struct fs_device *dev, blkno blk);
 extern u_long used_blocks(struct fs_device *dev);
+extern u_long used_inodes(struct fs_device *dev);
+
+/* from journal.c */
+extern bool open_journal(struct fs_device *dev, struct boot_blk *bb);
+extern void free_journal(struct fs_device *dev);
+extern bool close_journal(struct fs_device *dev);
+extern void journal_dirty(struct buf_head *bh);
+extern void journal_forget(struct fs_device *dev, blkno blk, u_long count);
+extern bool commit_journal(struct fs_device *dev);
+extern void commit_journals(void);
 
 /* from inode.c */
+extern struct inode_stats inode_stats;
 extern void init_inodes(void);
 extern void kill_inodes(void);
 extern struct core_inode *make_inode(struct fs_device *dev, u_long inum);
@@ -331,6 +702,10 @@ extern long alloc_inode(struct fs_device *dev);
 extern bool free_inode(struct fs_device *dev, u_long inum);
 extern bool read_inode(struct core_inode *inode);
 extern bool write_inode(struct core_inode *inode);
+extern bool peek_inode(struct fs_device *dev, u_long inum, struct inode *inode, struct buf_head **bufp);
+extern void clear_bmap_cache(struct core_inode *inode);
+extern bool reserve_blocks(struct core_inode *inode, blkno locality, u_long count);
+extern void release_blocks(struct core_inode *inode);
 extern blkno get_data_blkno(struct core_inode *inode, blkno blk, bool create);
 extern struct buf_head *get_data_block(struct core_inode *inode, blkno blk, bool create);
 
@@ -351,9 +726,13 @@ extern struct file *dup_file(struct file *file);
 extern long seek_file(struct file *file, long arg, int type);
 extern long read_file(void *buf, size_t len, struct file *file);
 extern long write_file(const void *buf, size_t len, struct file *file);
+extern long read_file_vec(const struct fs_iovec *iov, int count, struct file *file);
+extern long write_file_vec(const struct fs_iovec *iov, int count, struct file *file);
 extern bool delete_inode_data(struct core_inode *inode);
 extern bool truncate_file(struct file *file);
 extern bool set_file_size(struct file *file, size_t size);
+extern bool preallocate_file(struct file *file, size_t size);
+extern struct file *clone_file(const char *name, struct file *src);
 extern bool set_file_modes(const char *name, u_long mode);
 
 /* from dir.c */
@@ -370,33 +749,67 @@ extern bool remove_link(const char *name);
 extern bool remove_directory(const char *name);
 extern struct file *get_current_dir(void);
 extern struct file *swap_current_dir(struct file *dir);
+extern long read_dir_plus(struct file *dir, struct dir_plus *ents, int count);
+extern void free_dir_index(struct core_inode *inode);
+extern void init_dcache(void);
+extern void purge_dcache(struct fs_device *dev);
 
 /* from buffer.c */
-extern u_long total_accessed, cached_accesses, dirty_accesses;
+extern struct buffer_stats buf_stats;
+extern u_long bdflush_interval, bdflush_age, bdflush_ratio, bdflush_limit;
 extern void init_buffers(void);
 extern void kill_buffers(void);
 extern struct buf_head *bread(struct fs_device *dev, blkno blk);
+extern struct buf_head *bread_class(struct fs_device *dev, blkno blk,
+				    int class);
+extern void bread_ahead(struct fs_device *dev, blkno blk, int count);
 extern bool bwrite(struct fs_device *dev, blkno blk, const void *data);
+extern bool bwrite_vec(struct fs_device *dev, blkno blk, const struct fs_iovec *iov, int count, size_t offset);
 extern void bdirty(struct buf_head *bh, bool write_now);
 extern void brelse(struct buf_head *bh);
+extern bool bdirty_p(struct fs_device *dev, blkno blk);
+extern void bflush_blocks(struct fs_device *dev, blkno blk, int count);
+extern void bupdate_blocks(struct fs_device *dev, blkno blk, int count,
+			   const void *data);
+extern void bdirty_blocks(struct fs_device *dev, blkno blk, int count);
+extern void sync_buffers(void);
 extern void flush_device_cache(struct fs_device *dev, bool dont_write);
+extern void get_buffer_stats(struct buffer_stats *stats);
+extern void get_device_stats(struct fs_device *dev, struct fs_dev_stats *stats);
 extern bool test_media(struct fs_device *dev);
 
+/* from aio.c */
+extern void init_aio(void);
+extern void kill_aio(void);
+extern bool submit_request(struct fs_request *req);
+extern long wait_request(struct fs_request *req);
+extern bool cancel_request(struct fs_request *req);
+
 /* from mkfs.c */
 extern bool mkfs(struct fs_device *dev, u_long blocks, u_long reserved);
 
 /* from lib.c */
-extern int fs_putc(u_char c, struct file *fh);
-extern int fs_getc(struct file *fh);
-extern char *fs_read_line(char *buf, size_t bufsiz, struct file *fh);
-extern int fs_write_string(const char *str, struct file *fh);
-extern int fs_fvprintf(struct file *fh, const char *fmt, va_list args);
-extern int fs_fprintf(struct file *fh, const char *fmt, ...);
+extern struct fs_stream *open_stream(struct file *file, size_t bufsiz);
+extern bool flush_stream(struct fs_stream *s);
+extern bool close_stream(struct fs_stream *s);
+extern long read_stream(void *buf, size_t len, struct fs_stream *s);
+extern long write_stream(const void *buf, size_t len, struct fs_stream *s);
+extern int fs_putc(u_char c, struct fs_stream *s);
+extern int fs_getc(struct fs_stream *s);
+extern char *fs_read_line(char *buf, size_t bufsiz, struct fs_stream *s);
+extern int fs_write_string(const char *str, struct fs_stream *s);
+extern int fs_fvprintf(struct fs_stream *s, const char *fmt, va_list args);
+extern int fs_fprintf(struct fs_stream *s, const char *fmt, ...);
 
 #ifdef TEST
   /* from test_dev.c */
   extern bool open_test_dev(const char *file, u_long blocks, bool mkfs, u_long reserved);
   extern void close_test_dev(void);
+  extern u_long test_dev_delay;
+
+  /* from test/bench.c */
+  extern void add_bench_command(void);
+  extern void remove_bench_command(void);
 
   /* from ../shell/test.c */
   extern struct shell_module *shell;
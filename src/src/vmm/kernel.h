@@ -47,6 +47,9 @@ struct kernel_module
     void (*put_pd_val)(page_dir *pd, int size, u_long val, u_long lin_addr);
     u_long (*get_pd_val)(page_dir *pd, int size, u_long lin_addr);
     bool (*check_area)(page_dir *pd, u_long start, size_t extent);
+    u_long (*free_page_count)(void);
+    void (*add_page_shrinker)(struct page_shrinker *shrinker);
+    void (*remove_page_shrinker)(struct page_shrinker *shrinker);
 
     /* Kernel malloc functions. */
     void *(*malloc)(size_t size);
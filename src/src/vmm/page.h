@@ -21,6 +21,16 @@ typedef union _page {
     char mem[PAGE_SIZE];
 } page;
 
+/* Subsystems which keep pages they could give back (i.e. caches) can
+   register one of these; when alloc_page() finds no free pages it calls
+   each FUNC asking it to free up to COUNT pages. FUNC returns the number
+   of pages it actually freed. Note that FUNC is called with interrupts
+   masked and possibly from an interrupt handler, so it may *not* sleep. */
+struct page_shrinker {
+    struct page_shrinker *next;
+    u_long (*func)(u_long count);
+};
+
 /* Page-table-entry layout.
     31              12  11    8               0
    +------------------+------------------------+
@@ -105,6 +115,8 @@ extern void free_page(page *page);
 extern void free_pages(page *page, u_long n);
 extern void add_pages(u_long start, u_long end);
 extern u_long free_page_count(void);
+extern void add_page_shrinker(struct page_shrinker *shrinker);
+extern void remove_page_shrinker(struct page_shrinker *shrinker);
 extern void delete_page_dir(page_dir *pd);
 extern void delete_page_table(page_table *pt);
 extern void map_page(page_dir *pd, page *page, u_long addr, int flags);
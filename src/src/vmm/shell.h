@@ -11,7 +11,7 @@ struct shell {
 #ifndef TEST_SHELL
     struct task *task;
     struct tty *tty;
-    struct file *src;		/* If non-NULL read commands from here. */
+    struct fs_stream *src;	/* If non-NULL read commands from here. */
     struct shell_module *shell;
 #endif
     int last_rc;